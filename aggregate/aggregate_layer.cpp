@@ -1,6 +1,12 @@
 #include <algorithm>
+#include <cmath>
+#include <limits>
 #include <vector>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #include "caffe/layers/aggregate_layer.hpp"
 #include "caffe/util/math_functions.hpp"
 
@@ -9,46 +15,249 @@ namespace caffe {
 template <typename Dtype>
 void AggregateLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
     const vector<Blob<Dtype>*>& top) {
+  const AggregateParameter& aggregate_param = this->layer_param_.aggregate_param();
+  streaming_ = aggregate_param.streaming();
+  pool_ = aggregate_param.pool();
+  gem_p_ = aggregate_param.gem_p();
+  gem_eps_ = aggregate_param.gem_eps();
+  normalize_ = aggregate_param.normalize();
+  num_threads_ = 1;
+#ifdef _OPENMP
+  num_threads_ = aggregate_param.num_threads();
+  if (num_threads_ <= 0) { num_threads_ = omp_get_max_threads(); }
+#endif
+  if (pool_ == AggregateParameter_PoolMethod_GEM) {
+    CHECK_GT(gem_p_, 0) << "GeM pooling needs gem_p > 0.";
+    CHECK_GT(gem_eps_, 0) << "GeM pooling needs gem_eps > 0.";
+  }
+  stream_segments_ = 0;
+  rows_seen_ = row_offset_ = 0;
 }
 
 template <typename Dtype>
 void AggregateLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
     const vector<Blob<Dtype>*>& top) {
-  top[0]->Reshape(1, bottom[0]->channels(), 1, 1);
+  const int num = bottom[0]->shape(0);
+
+  // without segment ids every row belongs to segment 0
+  segment_.assign(num, 0);
+  num_segments_ = 1;
+  if (bottom.size() > 1) {
+    CHECK_EQ(bottom[1]->count(), num)
+        << "Aggregate takes one segment id per row of bottom[0].";
+    const Dtype* segment_data = bottom[1]->cpu_data();
+    num_segments_ = 0;
+    for (int i = 0; i < num; ++i) {
+      segment_[i] = static_cast<int>(segment_data[i]);
+      CHECK_GE(segment_[i], 0) << "Segment ids must be non-negative.";
+      num_segments_ = std::max(num_segments_, segment_[i] + 1);
+    }
+  }
+
+  // pool over the num axis only, every other axis (C x H x W) is kept
+  vector<int> top_shape = bottom[0]->shape();
+
+  if (streaming_) {
+    // a new row shape cannot continue the stream
+    const int dim = bottom[0]->count(1);
+    if (stream_segments_ > 0 && accumulator_.count(1) != dim) {
+      stream_segments_ = 0;
+    }
+    // top covers the segments seen so far in the stream; when a chunk brings new ones the
+    // accumulator grows and keeps its rows
+    num_segments_ = std::max(num_segments_, stream_segments_);
+    if (stream_segments_ == 0) {
+      top_shape[0] = num_segments_;
+      accumulator_.Reshape(top_shape);
+    } else if (num_segments_ > accumulator_.shape(0)) {
+      vector<Dtype> kept(accumulator_.cpu_data(),
+          accumulator_.cpu_data() + stream_segments_ * dim);
+      top_shape[0] = num_segments_;
+      accumulator_.Reshape(top_shape);
+      caffe_copy(stream_segments_ * dim, kept.data(), accumulator_.mutable_cpu_data());
+    }
+  }
+
+  top_shape[0] = num_segments_;
+  top[0]->Reshape(top_shape);
+  if (normalize_ || pool_ == AggregateParameter_PoolMethod_GEM) {
+    pooled_.Reshape(top_shape);
+  }
 }
 
 template <typename Dtype>
 void AggregateLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
-  Dtype * top_data = top[0]->mutable_cpu_data();
+  Dtype* top_data = top[0]->mutable_cpu_data();
   const Dtype* bottom_data = bottom[0]->cpu_data();
+  const int num = bottom[0]->shape(0);
+  const int dim = bottom[0]->count(1);
 
-  vector<float>tmp;
+  // rows per segment and index of the first row of this pass, over the whole stream when
+  // streaming (stream_segments_ is 0 otherwise)
+  if (stream_segments_ == 0) { rows_seen_ = 0; }
+  row_offset_ = rows_seen_;
+  counts_.resize(num_segments_);
+  std::fill(counts_.begin() + stream_segments_, counts_.end(), 0);
+  for (int i = 0; i < num; ++i) { ++counts_[segment_[i]]; }
+  if (pool_ == AggregateParameter_PoolMethod_MAX) { argmax_.resize(num_segments_ * dim); }
 
-  for (int i = 0; i < bottom[0]->channels(); i++) {
-    float sum = 0;
-    for (int j = 0; j < bottom[0]->num(); j++) {
-      int idx = j*bottom[0]->channels() + i;
-      sum += bottom_data[idx];
-      if (j == bottom[0]->num() - 1) {
-        tmp.push_back(sum);
+  // Pass over bottom: each thread owns a block of the dim outputs of every segment and
+  // streams the rows through it, so the block stays in cache and every row is read
+  // contiguously. top first holds the raw statistic of each segment, the sum of x (SUM,
+  // MEAN), the max of x (MAX) or the sum of max(x, gem_eps)^p (GEM). Every output visits
+  // its rows in the same order, so the result does not depend on the number of threads.
+  // A segment starts empty, or from the running statistic of the previous chunks when
+  // streaming.
+  const Dtype* stream_data = stream_segments_ > 0 ? accumulator_.cpu_data() : NULL;
+  const Dtype empty = (pool_ == AggregateParameter_PoolMethod_MAX) ?
+      -std::numeric_limits<Dtype>::max() : Dtype(0);
+  // One block per thread, in multiples of 16 outputs (a 64-byte line of floats), but no
+  // larger than the blocks of all segments together fit in half of a 512 KB L2.
+  const int block_cap = std::max(16,
+      static_cast<int>((256 << 10) / (num_segments_ * sizeof(Dtype))) / 16 * 16);
+  const int block = std::min(block_cap,
+      std::max(16, ((dim + num_threads_ - 1) / num_threads_ + 15) / 16 * 16));
+  const int num_blocks = (dim + block - 1) / block;
+#ifdef _OPENMP
+  #pragma omp parallel for num_threads(num_threads_) schedule(static)
+#endif
+  for (int b = 0; b < num_blocks; ++b) {
+    const int begin = b * block;
+    const int len = std::min(block, dim - begin);
+    for (int s = 0; s < num_segments_; ++s) {
+      if (s < stream_segments_) {
+        caffe_copy(len, stream_data + s * dim + begin, top_data + s * dim + begin);
+      } else {
+        caffe_set(len, empty, top_data + s * dim + begin);
+        if (pool_ == AggregateParameter_PoolMethod_MAX) {
+          std::fill(argmax_.begin() + s * dim + begin, argmax_.begin() + s * dim + begin + len, -1);
+        }
+      }
+    }
+    for (int i = 0; i < num; ++i) {
+      const Dtype* in = bottom_data + i * dim + begin;
+      Dtype* out = top_data + segment_[i] * dim + begin;
+      switch (pool_) {
+      case AggregateParameter_PoolMethod_SUM:
+      case AggregateParameter_PoolMethod_MEAN:
+        caffe_axpy(len, Dtype(1), in, out);
+        break;
+      case AggregateParameter_PoolMethod_MAX: {
+        int* arg = argmax_.data() + segment_[i] * dim + begin;
+        for (int k = 0; k < len; ++k) {
+          if (in[k] > out[k]) {
+            out[k] = in[k];
+            arg[k] = row_offset_ + i;
+          }
+        }
+        break;
+      }
+      case AggregateParameter_PoolMethod_GEM:
+        for (int k = 0; k < len; ++k) {
+          out[k] += std::pow(std::max(in[k], gem_eps_), gem_p_);
+        }
+        break;
+      default:
+        LOG(FATAL) << "Unknown pooling method.";
       }
     }
   }
-  for (int i = 0; i < bottom[0]->channels(); i++) {
-    top_data[i] = tmp[i];
+
+  if (streaming_) {
+    caffe_copy(top[0]->count(), top_data, accumulator_.mutable_cpu_data());
+    stream_segments_ = num_segments_;
+    rows_seen_ += num;
+  }
+
+  // Turn the statistic into the pooled value f of every segment, then y = f / ||f||. This
+  // only touches top, one segment per iteration.
+  norm_.resize(num_segments_);
+  Dtype* pooled_data = pooled_.count() > 0 ? pooled_.mutable_cpu_data() : NULL;
+#ifdef _OPENMP
+  #pragma omp parallel for num_threads(num_threads_) schedule(static)
+#endif
+  for (int s = 0; s < num_segments_; ++s) {
+    Dtype* f = top_data + s * dim;
+    if (counts_[s] == 0) {
+      caffe_set(dim, Dtype(0), f);
+    } else if (pool_ == AggregateParameter_PoolMethod_MEAN) {
+      caffe_scal(dim, Dtype(1) / counts_[s], f);
+    } else if (pool_ == AggregateParameter_PoolMethod_GEM) {
+      for (int k = 0; k < dim; ++k) {
+        f[k] = std::pow(f[k] / counts_[s], Dtype(1) / gem_p_);
+      }
+    }
+    if (pooled_data) { caffe_copy(dim, f, pooled_data + s * dim); }
+    if (normalize_) {
+      norm_[s] = std::sqrt(caffe_cpu_dot(dim, f, f));
+      caffe_scal(dim, norm_[s] > 0 ? Dtype(1) / norm_[s] : Dtype(0), f);
+    }
   }
-  tmp.clear();
 }
 
 template <typename Dtype>
 void AggregateLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
   const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
+  if (propagate_down.size() > 1 && propagate_down[1]) {
+    LOG(FATAL) << this->type()
+               << " Layer cannot backpropagate to segment id inputs.";
+  }
+  if (!propagate_down[0]) { return; }
   Dtype* bottom_diff = bottom[0]->mutable_cpu_diff();
-  const Dtype * top_diff = top[0]->cpu_diff();
-  int channels = bottom[0]->channels();
-  for (int i = 0; i < bottom[0]->num(); i++){
-    caffe_copy(channels, top_diff, bottom_diff + i*channels);
+  const Dtype* bottom_data = bottom[0]->cpu_data();
+  const Dtype* top_diff = top[0]->cpu_diff();
+  const int dim = bottom[0]->count(1);
+
+  // diff of the pooled value f: through y = f / ||f|| it is (dy - y * (y . dy)) / ||f||
+  const Dtype* pooled_diff = top_diff;
+  if (normalize_) {
+    const Dtype* top_data = top[0]->cpu_data();
+    Dtype* diff = pooled_.mutable_cpu_diff();
+    for (int s = 0; s < num_segments_; ++s) {
+      const Dtype a = caffe_cpu_dot(dim, top_data + s * dim, top_diff + s * dim);
+      caffe_copy(dim, top_diff + s * dim, diff + s * dim);
+      caffe_axpy(dim, -a, top_data + s * dim, diff + s * dim);
+      caffe_scal(dim, norm_[s] > 0 ? Dtype(1) / norm_[s] : Dtype(0), diff + s * dim);
+    }
+    pooled_diff = diff;
+  }
+
+  // every row gets the diff of its segment, weighted by d f / d x
+#ifdef _OPENMP
+  #pragma omp parallel for num_threads(num_threads_) schedule(static)
+#endif
+  for (int i = 0; i < bottom[0]->shape(0); i++) {
+    const int s = segment_[i];
+    const Dtype* g = pooled_diff + s * dim;
+    const Dtype* x = bottom_data + i * dim;
+    Dtype* dx = bottom_diff + i * dim;
+    switch (pool_) {
+    case AggregateParameter_PoolMethod_SUM:
+      caffe_copy(dim, g, dx);
+      break;
+    case AggregateParameter_PoolMethod_MEAN:
+      caffe_cpu_scale(dim, Dtype(1) / counts_[s], g, dx);
+      break;
+    case AggregateParameter_PoolMethod_MAX: {
+      const int* arg = argmax_.data() + s * dim;
+      for (int k = 0; k < dim; ++k) {
+        dx[k] = (arg[k] == row_offset_ + i) ? g[k] : Dtype(0);
+      }
+      break;
+    }
+    case AggregateParameter_PoolMethod_GEM: {
+      // d f / d x = f^(1-p) * x^(p-1) / count, 0 where x is clamped to gem_eps
+      const Dtype* f = pooled_.cpu_data() + s * dim;
+      for (int k = 0; k < dim; ++k) {
+        dx[k] = x[k] > gem_eps_ ? g[k] * std::pow(f[k], 1 - gem_p_)
+            * std::pow(x[k], gem_p_ - 1) / counts_[s] : Dtype(0);
+      }
+      break;
+    }
+    default:
+      LOG(FATAL) << "Unknown pooling method.";
+    }
   }
 }
 
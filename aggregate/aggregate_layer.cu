@@ -8,21 +8,40 @@ namespace caffe {
 template <typename Dtype>
 void AggregateLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
+  // only plain sums run on the GPU, the other pooling methods and the normalization use the
+  // CPU implementation
+  if (pool_ != AggregateParameter_PoolMethod_SUM || normalize_) {
+    Forward_cpu(bottom, top);
+    return;
+  }
   Dtype * top_data = top[0]->mutable_gpu_data();
-  int channels = bottom[0]->channels();
+  int dim = bottom[0]->count(1);
+  // when streaming, the segments of the previous chunks start from their running aggregate
   caffe_gpu_set(top[0]->count(), Dtype(0), top[0]->mutable_gpu_data());
+  if (streaming_) {
+    caffe_copy(stream_segments_ * dim, accumulator_.gpu_data(), top_data);
+  }
   for(int i = 0; i < bottom[0]->num(); ++i){
-    caffe_gpu_add(channels, bottom[0]->gpu_data() + i*channels, top_data, top_data);
+    Dtype* segment_data = top_data + segment_[i]*dim;
+    caffe_gpu_add(dim, bottom[0]->gpu_data() + i*dim, segment_data, segment_data);
+  }
+  if (streaming_) {
+    caffe_copy(top[0]->count(), top_data, accumulator_.mutable_gpu_data());
+    stream_segments_ = num_segments_;
   }
 }
 
 template <typename Dtype>
 void AggregateLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
-  int channels = bottom[0]->channels();
+  if (pool_ != AggregateParameter_PoolMethod_SUM || normalize_ || !propagate_down[0]) {
+    Backward_cpu(top, propagate_down, bottom);
+    return;
+  }
+  int dim = bottom[0]->count(1);
   Dtype* bottom_diff = bottom[0]->mutable_gpu_diff();
   for(int i = 0;i < bottom[0]->num(); ++i){
-    caffe_gpu_memcpy(channels, top[0]->gpu_diff(), bottom_diff + i*channels);
+    caffe_copy(dim, top[0]->gpu_diff() + segment_[i]*dim, bottom_diff + i*dim);
   }
 }
 
@@ -25,7 +25,8 @@ template <typename Dtype>
 class AggregateLayer : public Layer<Dtype> {
  public:
   explicit AggregateLayer(const LayerParameter& param)
-      : Layer<Dtype>(param) {}
+      : Layer<Dtype>(param), num_segments_(1), streaming_(false),
+        stream_segments_(0), rows_seen_(0), row_offset_(0) {}
   virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
   virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
@@ -33,9 +34,15 @@ class AggregateLayer : public Layer<Dtype> {
 
   virtual inline const char* type() const { return "Aggregate"; }
   virtual inline int ExactNumBottomBlobs() const { return -1; }
+  // bottom[1], if any, holds the segment id of every row of bottom[0]
+  virtual inline int MinBottomBlobs() const { return 1; }
+  virtual inline int MaxBottomBlobs() const { return 2; }
   virtual inline int ExactNumTopBlobs() const { return 1; }
   virtual inline int MinTopBlobs() const { return 1; }
 
+  // streaming mode: drop the running aggregate, the next forward pass starts a new one
+  void BeginStream() { stream_segments_ = 0; }
+
  protected:
   virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
@@ -45,6 +52,26 @@ class AggregateLayer : public Layer<Dtype> {
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
   virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+
+  vector<int> segment_;  // segment of every row of bottom[0], i.e. its row in top
+  int num_segments_;
+
+  AggregateParameter_PoolMethod pool_;
+  Dtype gem_p_;
+  Dtype gem_eps_;
+  bool normalize_;  // top is the L2-normalized pooled value
+  int num_threads_;  // OpenMP threads of the CPU passes
+
+  bool streaming_;
+  int stream_segments_;  // segments held by accumulator_, 0 at the start of a stream
+  int rows_seen_;  // rows pooled so far in the stream
+  int row_offset_;  // stream index of the first row of the last forward pass
+  Blob<Dtype> accumulator_;  // running statistic of the stream, one row per segment
+
+  vector<int> counts_;  // rows pooled into each segment
+  vector<int> argmax_;  // MAX: stream index of the row each output was taken from
+  Blob<Dtype> pooled_;  // pooled value before normalization (data) and its diff
+  vector<Dtype> norm_;  // L2 norm of the pooled value of each segment
 };
 
 }  // namespace caffe
@@ -0,0 +1,272 @@
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/filler.hpp"
+#include "caffe/layers/aggregate_layer.hpp"
+#include "caffe/util/math_functions.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+#include "caffe/test/test_gradient_check_util.hpp"
+
+namespace caffe {
+
+template <typename TypeParam>
+class AggregateLayerTest : public MultiDeviceTest<TypeParam> {
+  typedef typename TypeParam::Dtype Dtype;
+
+ protected:
+  AggregateLayerTest()
+      : blob_bottom_(new Blob<Dtype>(5, 3, 2, 2)),
+        blob_bottom_segment_(new Blob<Dtype>(5, 1, 1, 1)),
+        blob_top_(new Blob<Dtype>()) {
+    FillerParameter filler_param;
+    filler_param.set_min(-1);
+    filler_param.set_max(1);
+    UniformFiller<Dtype> filler(filler_param);
+    filler.Fill(this->blob_bottom_);
+    // segment 1 gets no rows
+    const int segment[5] = {0, 2, 2, 0, 2};
+    for (int i = 0; i < 5; ++i) {
+      blob_bottom_segment_->mutable_cpu_data()[i] = segment[i];
+    }
+    blob_bottom_vec_.push_back(blob_bottom_);
+    blob_bottom_vec_.push_back(blob_bottom_segment_);
+    blob_top_vec_.push_back(blob_top_);
+  }
+  virtual ~AggregateLayerTest() {
+    delete blob_bottom_;
+    delete blob_bottom_segment_;
+    delete blob_top_;
+  }
+
+  // Distinct values at least 1/30 apart and 1/60 away from 0, so no finite-difference step
+  // crosses a MAX tie or the GeM clamp at gem_eps.
+  void FillSpaced() {
+    const int count = this->blob_bottom_->count();
+    Dtype* x = this->blob_bottom_->mutable_cpu_data();
+    for (int i = 0; i < count; ++i) {
+      x[i] = Dtype((i * 37) % count * 2 + 1) / count - 1;
+    }
+  }
+
+  void TestGradient(const AggregateParameter_PoolMethod pool, const bool normalize) {
+    LayerParameter layer_param;
+    layer_param.mutable_aggregate_param()->set_pool(pool);
+    layer_param.mutable_aggregate_param()->set_normalize(normalize);
+    AggregateLayer<Dtype> layer(layer_param);
+    FillSpaced();
+    GradientChecker<Dtype> checker(1e-2, 1e-3);
+    checker.CheckGradientExhaustive(&layer, this->blob_bottom_vec_, this->blob_top_vec_, 0);
+  }
+
+  Blob<Dtype>* const blob_bottom_;
+  Blob<Dtype>* const blob_bottom_segment_;
+  Blob<Dtype>* const blob_top_;
+  vector<Blob<Dtype>*> blob_bottom_vec_;
+  vector<Blob<Dtype>*> blob_top_vec_;
+};
+
+TYPED_TEST_CASE(AggregateLayerTest, TestDtypesAndDevices);
+
+TYPED_TEST(AggregateLayerTest, TestSetUp) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  AggregateLayer<Dtype> layer(layer_param);
+  // one row per segment, up to the largest id, in place of num
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  EXPECT_EQ(this->blob_top_->num(), 3);
+  EXPECT_EQ(this->blob_top_->channels(), 3);
+  EXPECT_EQ(this->blob_top_->height(), 2);
+  EXPECT_EQ(this->blob_top_->width(), 2);
+  // without segment ids all rows go to a single one
+  this->blob_bottom_vec_.pop_back();
+  AggregateLayer<Dtype> layer_single(layer_param);
+  layer_single.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  EXPECT_EQ(this->blob_top_->num(), 1);
+  EXPECT_EQ(this->blob_top_->channels(), 3);
+}
+
+TYPED_TEST(AggregateLayerTest, TestForwardSum) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  AggregateLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  const Dtype* x = this->blob_bottom_->cpu_data();
+  const Dtype* y = this->blob_top_->cpu_data();
+  const int dim = this->blob_bottom_->count(1);
+  for (int k = 0; k < dim; ++k) {
+    EXPECT_NEAR(y[k], x[k] + x[3 * dim + k], 1e-6);
+    EXPECT_EQ(y[dim + k], 0);
+    EXPECT_NEAR(y[2 * dim + k], x[dim + k] + x[2 * dim + k] + x[4 * dim + k], 1e-6);
+  }
+}
+
+TYPED_TEST(AggregateLayerTest, TestBackwardSum) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  AggregateLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  caffe_rng_uniform<Dtype>(this->blob_top_->count(), Dtype(-1), Dtype(1),
+      this->blob_top_->mutable_cpu_diff());
+  vector<bool> propagate_down(2, true);
+  propagate_down[1] = false;
+  layer.Backward(this->blob_top_vec_, propagate_down, this->blob_bottom_vec_);
+  // every row gets the diff of its segment
+  const Dtype* top_diff = this->blob_top_->cpu_diff();
+  const Dtype* bottom_diff = this->blob_bottom_->cpu_diff();
+  const int dim = this->blob_bottom_->count(1);
+  for (int i = 0; i < 5; ++i) {
+    const int s = static_cast<int>(this->blob_bottom_segment_->cpu_data()[i]);
+    for (int k = 0; k < dim; ++k) {
+      EXPECT_EQ(bottom_diff[i * dim + k], top_diff[s * dim + k]);
+    }
+  }
+}
+
+// Feeding the rows in chunks to a streaming layer must end with the aggregate of a single
+// pass over all of them, whichever chunk a segment's rows arrive in.
+TYPED_TEST(AggregateLayerTest, TestStreaming) {
+  typedef typename TypeParam::Dtype Dtype;
+  const AggregateParameter_PoolMethod pools[4] = {AggregateParameter_PoolMethod_SUM,
+      AggregateParameter_PoolMethod_MEAN, AggregateParameter_PoolMethod_MAX,
+      AggregateParameter_PoolMethod_GEM};
+  const int dim = this->blob_bottom_->count(1);
+  const int chunk_begin[4] = {0, 2, 3, 5};
+  for (int p = 0; p < 8; ++p) {
+    LayerParameter layer_param;
+    layer_param.mutable_aggregate_param()->set_pool(pools[p % 4]);
+    layer_param.mutable_aggregate_param()->set_normalize(p >= 4);
+    AggregateLayer<Dtype> layer(layer_param);
+    layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    const vector<Dtype> expected(this->blob_top_->cpu_data(),
+        this->blob_top_->cpu_data() + this->blob_top_->count());
+
+    layer_param.mutable_aggregate_param()->set_streaming(true);
+    AggregateLayer<Dtype> layer_stream(layer_param);
+    Blob<Dtype> chunk, chunk_segment;
+    vector<Blob<Dtype>*> chunk_vec;
+    chunk_vec.push_back(&chunk);
+    chunk_vec.push_back(&chunk_segment);
+    // two streams: the second must not see the rows of the first
+    for (int stream = 0; stream < 2; ++stream) {
+      layer_stream.BeginStream();
+      for (int c = 0; c < 3; ++c) {
+        const int rows = chunk_begin[c + 1] - chunk_begin[c];
+        chunk.Reshape(rows, 3, 2, 2);
+        chunk_segment.Reshape(rows, 1, 1, 1);
+        caffe_copy(rows * dim, this->blob_bottom_->cpu_data() + chunk_begin[c] * dim,
+            chunk.mutable_cpu_data());
+        caffe_copy(rows, this->blob_bottom_segment_->cpu_data() + chunk_begin[c],
+            chunk_segment.mutable_cpu_data());
+        if (stream == 0 && c == 0) {
+          layer_stream.SetUp(chunk_vec, this->blob_top_vec_);
+        }
+        layer_stream.Forward(chunk_vec, this->blob_top_vec_);
+      }
+      ASSERT_EQ(this->blob_top_->count(), static_cast<int>(expected.size()));
+      for (int i = 0; i < this->blob_top_->count(); ++i) {
+        EXPECT_NEAR(this->blob_top_->cpu_data()[i], expected[i], 1e-5)
+            << "pool " << pools[p % 4] << " normalize " << (p >= 4) << " stream " << stream
+            << " at " << i;
+      }
+    }
+  }
+}
+
+TYPED_TEST(AggregateLayerTest, TestGradientSum) {
+  this->TestGradient(AggregateParameter_PoolMethod_SUM, false);
+}
+
+TYPED_TEST(AggregateLayerTest, TestGradientSumNormalize) {
+  this->TestGradient(AggregateParameter_PoolMethod_SUM, true);
+}
+
+TYPED_TEST(AggregateLayerTest, TestGradientMean) {
+  this->TestGradient(AggregateParameter_PoolMethod_MEAN, false);
+}
+
+TYPED_TEST(AggregateLayerTest, TestGradientMeanNormalize) {
+  this->TestGradient(AggregateParameter_PoolMethod_MEAN, true);
+}
+
+TYPED_TEST(AggregateLayerTest, TestGradientMax) {
+  this->TestGradient(AggregateParameter_PoolMethod_MAX, false);
+}
+
+TYPED_TEST(AggregateLayerTest, TestGradientMaxNormalize) {
+  this->TestGradient(AggregateParameter_PoolMethod_MAX, true);
+}
+
+TYPED_TEST(AggregateLayerTest, TestGradientGeM) {
+  this->TestGradient(AggregateParameter_PoolMethod_GEM, false);
+}
+
+TYPED_TEST(AggregateLayerTest, TestGradientGeMNormalize) {
+  this->TestGradient(AggregateParameter_PoolMethod_GEM, true);
+}
+
+// MAX is not differentiable at a tie: the whole diff goes to the first of the tied rows.
+TYPED_TEST(AggregateLayerTest, TestMaxTies) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  layer_param.mutable_aggregate_param()->set_pool(AggregateParameter_PoolMethod_MAX);
+  AggregateLayer<Dtype> layer(layer_param);
+  const int dim = this->blob_bottom_->count(1);
+  Dtype* x = this->blob_bottom_->mutable_cpu_data();
+  // segment 0 (rows 0, 3) ties everywhere, segment 2 (rows 1, 2, 4) has rows 2 and 4 tied
+  // at its maximum
+  for (int k = 0; k < dim; ++k) {
+    x[3 * dim + k] = x[k];
+    x[dim + k] = -2;
+    x[4 * dim + k] = x[2 * dim + k];
+  }
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  caffe_rng_uniform<Dtype>(this->blob_top_->count(), Dtype(-1), Dtype(1),
+      this->blob_top_->mutable_cpu_diff());
+  vector<bool> propagate_down(2, true);
+  propagate_down[1] = false;
+  layer.Backward(this->blob_top_vec_, propagate_down, this->blob_bottom_vec_);
+  const Dtype* top_diff = this->blob_top_->cpu_diff();
+  const Dtype* bottom_diff = this->blob_bottom_->cpu_diff();
+  for (int k = 0; k < dim; ++k) {
+    EXPECT_EQ(this->blob_top_->cpu_data()[k], x[k]);
+    EXPECT_EQ(bottom_diff[k], top_diff[k]);
+    EXPECT_EQ(bottom_diff[3 * dim + k], 0);
+    EXPECT_EQ(bottom_diff[dim + k], 0);
+    EXPECT_EQ(bottom_diff[2 * dim + k], top_diff[2 * dim + k]);
+    EXPECT_EQ(bottom_diff[4 * dim + k], 0);
+  }
+}
+
+// GeM clamps x to gem_eps: rows below it get no gradient, and a segment whose rows are all
+// below it pools to gem_eps. The checker skips features within a step of the clamp.
+TYPED_TEST(AggregateLayerTest, TestGradientGeMClamped) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  layer_param.mutable_aggregate_param()->set_pool(AggregateParameter_PoolMethod_GEM);
+  layer_param.mutable_aggregate_param()->set_gem_eps(0.1);
+  AggregateLayer<Dtype> layer(layer_param);
+  this->FillSpaced();
+  const int dim = this->blob_bottom_->count(1);
+  Dtype* x = this->blob_bottom_->mutable_cpu_data();
+  // rows 0 and 3 (all of segment 0) below gem_eps in the first channel
+  for (int k = 0; k < 4; ++k) {
+    x[k] = -0.5;
+    x[3 * dim + k] = 0.05;
+  }
+  GradientChecker<Dtype> checker(1e-2, 1e-3, 1701, 0.1, 1e-2);
+  checker.CheckGradientExhaustive(&layer, this->blob_bottom_vec_, this->blob_top_vec_, 0);
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  for (int k = 0; k < 4; ++k) {
+    EXPECT_NEAR(this->blob_top_->cpu_data()[k], 0.1, 1e-6);
+  }
+}
+
+}  // namespace caffe
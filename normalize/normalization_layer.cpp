@@ -6,28 +6,40 @@
 #include <vector>
 #include <cmath>
 
-#include "caffe/layer.hpp"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "caffe/layers/normalization_layer.hpp"
 #include "caffe/util/math_functions.hpp"
-#include "caffe/vision_layers.hpp"
 
 namespace caffe {
 
-// template <typename Dtype>
-// void NormalizationLayer<Dtype>::LayerSetUp(
-//   const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
-//   Layer<Dtype>::LayerSetUp(bottom, top);
-// }
+template <typename Dtype>
+void NormalizationLayer<Dtype>::LayerSetUp(
+  const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  eps_ = this->layer_param_.normalization_param().eps();
+  across_spatial_ = this->layer_param_.normalization_param().across_spatial();
+  num_threads_ = 1;
+#ifdef _OPENMP
+  num_threads_ = this->layer_param_.normalization_param().num_threads();
+  if (num_threads_ <= 0) { num_threads_ = omp_get_max_threads(); }
+#endif
+}
 
 template <typename Dtype>
 void NormalizationLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
     const vector<Blob<Dtype>*>& top) {
-  // Layer<Dtype>::Reshape(bottom, top);
   top[0]->ReshapeLike(*bottom[0]);
-  squared_.ReshapeLike(*bottom[0]);
-  // top[0]->Reshape(bottom[0]->num(), bottom[0]->channels(),
-  //     bottom[0]->height(), bottom[0]->width());
-  // squared_.Reshape(bottom[0]->num(), bottom[0]->channels(), 
-  //   bottom[0]->height(), bottom[0]->width());
+  if (across_spatial_) {
+    inv_norm_.Reshape(bottom[0]->num(), 1, 1, 1);
+  } else {
+    // one norm per position of the axes after the channels
+    vector<int> norm_shape = bottom[0]->shape();
+    norm_shape[1] = 1;
+    inv_norm_.Reshape(norm_shape);
+    spatial_dot_.Reshape(norm_shape);
+  }
 }
 
 template <typename Dtype>
@@ -35,13 +47,48 @@ void NormalizationLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
     const vector<Blob<Dtype>*>& top) {
   const Dtype* bottom_data = bottom[0]->cpu_data();
   Dtype* top_data = top[0]->mutable_cpu_data();
-  Dtype* squared_data = squared_.mutable_cpu_data();
+  Dtype* inv_norm = inv_norm_.mutable_cpu_data();
   int n = bottom[0]->num();
   int d = bottom[0]->count() / n;
-  caffe_sqr<Dtype>(n*d, bottom_data, squared_data);
+  if (across_spatial_) {
+    // squared norm with a BLAS dot, then one scaling pass, no temporary
+#ifdef _OPENMP
+    #pragma omp parallel for num_threads(num_threads_) schedule(static)
+#endif
+    for (int i=0; i<n; ++i) {
+      Dtype normsqr = caffe_cpu_dot(d, bottom_data+i*d, bottom_data+i*d);
+      inv_norm[i] = Dtype(1) / std::sqrt(normsqr + eps_);
+      if (top_data == bottom_data) {
+        caffe_scal<Dtype>(d, inv_norm[i], top_data+i*d);
+      } else {
+        caffe_cpu_scale<Dtype>(d, inv_norm[i], bottom_data+i*d, top_data+i*d);
+      }
+    }
+    return;
+  }
+  // per position: the squared norms of a sample are summed plane by plane into its
+  // H x W slice of inv_norm_, so every pass reads whole contiguous planes
+  int c = bottom[0]->channels();
+  int sp = d / c;
+#ifdef _OPENMP
+  #pragma omp parallel for num_threads(num_threads_) schedule(static)
+#endif
   for (int i=0; i<n; ++i) {
-    Dtype normsqr = caffe_cpu_asum<Dtype>(d, squared_data+i*d);
-    caffe_cpu_scale<Dtype>(d, pow(normsqr, -0.5), bottom_data+i*d, top_data+i*d);
+    const Dtype* x = bottom_data + i*d;
+    Dtype* y = top_data + i*d;
+    Dtype* r = inv_norm + i*sp;
+    caffe_set(sp, eps_, r);
+    for (int j=0; j<c; ++j) {
+      for (int k=0; k<sp; ++k) {
+        r[k] += x[j*sp+k] * x[j*sp+k];
+      }
+    }
+    for (int k=0; k<sp; ++k) {
+      r[k] = Dtype(1) / std::sqrt(r[k]);
+    }
+    for (int j=0; j<c; ++j) {
+      caffe_mul(sp, x+j*sp, r, y+j*sp);
+    }
   }
 }
 
@@ -50,16 +97,52 @@ void NormalizationLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
     const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
   const Dtype* top_diff = top[0]->cpu_diff();
   const Dtype* top_data = top[0]->cpu_data();
-  const Dtype* bottom_data = bottom[0]->cpu_data();
+  const Dtype* inv_norm = inv_norm_.cpu_data();
   Dtype* bottom_diff = bottom[0]->mutable_cpu_diff();
   int n = top[0]->num();
   int d = top[0]->count() / n;
+  // with y = x * r and r = 1 / sqrt(||x||^2 + eps): dx = r * (dy - y * (y . dy)), exactly.
+  // Only y and r are read, never x, so the layer can run in place (top == bottom, and then
+  // bottom_diff == top_diff: every y . dy is taken before its dy is overwritten)
+  if (across_spatial_) {
+#ifdef _OPENMP
+    #pragma omp parallel for num_threads(num_threads_) schedule(static)
+#endif
+    for (int i=0; i<n; ++i) {
+      Dtype a = caffe_cpu_dot(d, top_data+i*d, top_diff+i*d);
+      if (bottom_diff == top_diff) {
+        caffe_scal(d, inv_norm[i], bottom_diff+i*d);
+      } else {
+        caffe_cpu_scale(d, inv_norm[i], top_diff+i*d, bottom_diff+i*d);
+      }
+      caffe_axpy(d, -a * inv_norm[i], top_data+i*d, bottom_diff+i*d);
+    }
+    return;
+  }
+  // per position, with y . dy summed plane by plane like the norms
+  int c = top[0]->channels();
+  int sp = d / c;
+  Dtype* spatial_dot = spatial_dot_.mutable_cpu_data();
+#ifdef _OPENMP
+  #pragma omp parallel for num_threads(num_threads_) schedule(static)
+#endif
   for (int i=0; i<n; ++i) {
-    Dtype a = caffe_cpu_dot(d, top_data+i*d, top_diff+i*d);
-    caffe_cpu_scale(d, a, top_data+i*d, bottom_diff+i*d);
-    caffe_sub(d, top_diff+i*d, bottom_diff+i*d, bottom_diff+i*d);
-    a = caffe_cpu_dot(d, bottom_data+i*d, bottom_data+i*d);
-    caffe_cpu_scale(d, Dtype(pow(a, -0.5)), bottom_diff+i*d, bottom_diff+i*d);
+    const Dtype* y = top_data + i*d;
+    const Dtype* dy = top_diff + i*d;
+    const Dtype* r = inv_norm + i*sp;
+    Dtype* a = spatial_dot + i*sp;
+    Dtype* dx = bottom_diff + i*d;
+    caffe_set(sp, Dtype(0), a);
+    for (int j=0; j<c; ++j) {
+      for (int k=0; k<sp; ++k) {
+        a[k] += y[j*sp+k] * dy[j*sp+k];
+      }
+    }
+    for (int j=0; j<c; ++j) {
+      for (int k=0; k<sp; ++k) {
+        dx[j*sp+k] = r[k] * (dy[j*sp+k] - y[j*sp+k] * a[k]);
+      }
+    }
   }
 }
 
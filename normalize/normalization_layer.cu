@@ -7,72 +7,59 @@
 #include <cfloat>
 #include <vector>
 
-// #include "thrust/device_vector.h"
-#include "caffe/util/io.hpp"
-#include "caffe/layer.hpp"
+#include "caffe/layers/normalization_layer.hpp"
 #include "caffe/util/math_functions.hpp"
-#include "caffe/vision_layers.hpp"
 
 namespace caffe {
 
 template <typename Dtype>
 void NormalizationLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
     const vector<Blob<Dtype>*>& top) {
+  if (!across_spatial_) {
+    // per-position norms are plane-by-plane CPU loops
+    Forward_cpu(bottom, top);
+    return;
+  }
   const Dtype* bottom_data = bottom[0]->gpu_data();
   Dtype* top_data = top[0]->mutable_gpu_data();
-  Dtype* squared_data = squared_.mutable_gpu_data();
+  Dtype* inv_norm = inv_norm_.mutable_cpu_data();
   Dtype normsqr;
   int n = bottom[0]->num();
   int d = bottom[0]->count() / n;
-  caffe_gpu_powx(n*d, bottom_data, Dtype(2), squared_data);
-  for (int i=0; i<n; ++i) {
-    caffe_gpu_asum<Dtype>(d, squared_data+i*d, &normsqr);
-    caffe_gpu_scale<Dtype>(d, pow(normsqr, -0.5), bottom_data+i*d, top_data+i*d);
-  }
-/*
-  const Dtype* out = top[0]->cpu_data();
   for (int i=0; i<n; ++i) {
-    int ptr = i*d;
-    //Dtype tmp = 0.0;
-    std::cout << i << ": ";
-    for (int j=0; j < d; ++j) {
-	//tmp += out[ptr]*out[ptr++];
-	std::cout << out[ptr++] << " ";
+    caffe_gpu_dot(d, bottom_data+i*d, bottom_data+i*d, &normsqr);
+    inv_norm[i] = Dtype(1) / sqrt(normsqr + eps_);
+    if (top_data == bottom_data) {
+      caffe_gpu_scal<Dtype>(d, inv_norm[i], top_data+i*d);
+    } else {
+      caffe_gpu_scale<Dtype>(d, inv_norm[i], bottom_data+i*d, top_data+i*d);
     }
-    std::cout << "\n";
-//    LOG(INFO) << i << ": " << tmp;
   }
-*/
 }
-  
+
 template <typename Dtype>
 void NormalizationLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
     const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
+  if (!across_spatial_) {
+    Backward_cpu(top, propagate_down, bottom);
+    return;
+  }
   const Dtype* top_diff = top[0]->gpu_diff();
   const Dtype* top_data = top[0]->gpu_data();
-  const Dtype* bottom_data = bottom[0]->gpu_data();
+  const Dtype* inv_norm = inv_norm_.cpu_data();
   Dtype* bottom_diff = bottom[0]->mutable_gpu_diff();
   int n = top[0]->num();
   int d = top[0]->count() / n;
   Dtype a;
   for (int i=0; i<n; ++i) {
     caffe_gpu_dot(d, top_data+i*d, top_diff+i*d, &a);
-    caffe_gpu_scale(d, a, top_data+i*d, bottom_diff+i*d);
-    caffe_gpu_sub(d, top_diff+i*d, bottom_diff+i*d, bottom_diff+i*d);
-    caffe_gpu_dot(d, bottom_data+i*d, bottom_data+i*d, &a);
-    caffe_gpu_scale(d, Dtype(pow(a, -0.5)), bottom_diff+i*d, bottom_diff+i*d);
-  }
-/*
-const Dtype* b = bottom[0]->cpu_data();
-for (int i = 0; i < n; i++) {
-    std::cout << i << ": ";
-    int tmp = i*128;
-    for (int j = 0; j < 128; j++) {
-	std::cout << b[tmp++] << " ";
+    if (bottom_diff == top_diff) {
+      caffe_gpu_scal(d, inv_norm[i], bottom_diff+i*d);
+    } else {
+      caffe_gpu_scale(d, inv_norm[i], top_diff+i*d, bottom_diff+i*d);
     }
-    std::cout << "\n:";
-}
-*/
+    caffe_gpu_axpy(d, -a * inv_norm[i], top_data+i*d, bottom_diff+i*d);
+  }
 }
 
 // INSTANTIATE_CLASS(NormalizationLayer);
@@ -0,0 +1,54 @@
+#ifndef CAFFE_NORMALIZATION_LAYER_HPP_
+#define CAFFE_NORMALIZATION_LAYER_HPP_
+
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/proto/caffe.pb.h"
+
+namespace caffe {
+
+/**
+ * @brief L2-normalizes every sample: y = x / sqrt(||x||^2 + eps), or with
+ *        across_spatial: false the channels of every spatial position.
+ *
+ * Backward needs only the output and the cached norms, so the layer may run in
+ * place (top: same name as bottom) and then owns no activation of its own.
+ */
+template <typename Dtype>
+class NormalizationLayer : public Layer<Dtype> {
+ public:
+  explicit NormalizationLayer(const LayerParameter& param)
+      : Layer<Dtype>(param) {}
+  virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+
+  virtual inline const char* type() const { return "Normalization"; }
+  virtual inline int ExactNumBottomBlobs() const { return 1; }
+  virtual inline int ExactNumTopBlobs() const { return 1; }
+
+ protected:
+  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+  virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+
+  Dtype eps_;
+  bool across_spatial_;
+  int num_threads_;  // OpenMP threads of the CPU passes
+  // 1 / sqrt(||x||^2 + eps) of every sample (N x 1 x 1 x 1) or, when not across_spatial_, of
+  // every spatial position (N x 1 x H x W), kept for backward
+  Blob<Dtype> inv_norm_;
+  Blob<Dtype> spatial_dot_;  // per position y . dy in backward when not across_spatial_
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_NORMALIZATION_LAYER_HPP_
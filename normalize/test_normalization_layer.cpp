@@ -0,0 +1,143 @@
+#include <cmath>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/filler.hpp"
+#include "caffe/layers/normalization_layer.hpp"
+#include "caffe/util/math_functions.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+#include "caffe/test/test_gradient_check_util.hpp"
+
+namespace caffe {
+
+template <typename TypeParam>
+class NormalizationLayerTest : public MultiDeviceTest<TypeParam> {
+  typedef typename TypeParam::Dtype Dtype;
+
+ protected:
+  NormalizationLayerTest()
+      : blob_bottom_(new Blob<Dtype>(4, 5, 3, 2)),
+        blob_top_(new Blob<Dtype>()) {
+    FillerParameter filler_param;
+    filler_param.set_min(-1);
+    filler_param.set_max(1);
+    UniformFiller<Dtype> filler(filler_param);
+    filler.Fill(this->blob_bottom_);
+    blob_bottom_vec_.push_back(blob_bottom_);
+    blob_top_vec_.push_back(blob_top_);
+  }
+  virtual ~NormalizationLayerTest() {
+    delete blob_bottom_;
+    delete blob_top_;
+  }
+
+  // y = x / ||x|| over the whole sample, or over the channels of every position
+  void TestForward(const bool across_spatial) {
+    LayerParameter layer_param;
+    layer_param.mutable_normalization_param()->set_across_spatial(across_spatial);
+    NormalizationLayer<Dtype> layer(layer_param);
+    layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    const Dtype* x = this->blob_bottom_->cpu_data();
+    const Dtype* y = this->blob_top_->cpu_data();
+    const int channels = this->blob_bottom_->channels();
+    const int spatial = this->blob_bottom_->count(2);
+    for (int n = 0; n < this->blob_bottom_->num(); ++n) {
+      for (int s = 0; s < spatial; ++s) {
+        const int begin = across_spatial ? 0 : s, end = across_spatial ? spatial : s + 1;
+        Dtype normsqr = 0;
+        for (int c = 0; c < channels; ++c) {
+          for (int t = begin; t < end; ++t) {
+            const Dtype v = x[(n * channels + c) * spatial + t];
+            normsqr += v * v;
+          }
+        }
+        for (int c = 0; c < channels; ++c) {
+          const int i = (n * channels + c) * spatial + s;
+          EXPECT_NEAR(y[i], x[i] / std::sqrt(normsqr), 1e-5);
+        }
+      }
+    }
+  }
+
+  // Running in place (top == bottom) must give the same output and bottom diff as a
+  // separate top, although backward then no longer sees x.
+  void TestInPlace(const bool across_spatial) {
+    LayerParameter layer_param;
+    layer_param.mutable_normalization_param()->set_across_spatial(across_spatial);
+    NormalizationLayer<Dtype> layer(layer_param);
+    layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+    caffe_rng_uniform<Dtype>(this->blob_top_->count(), Dtype(-1), Dtype(1),
+        this->blob_top_->mutable_cpu_diff());
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    vector<bool> propagate_down(1, true);
+    layer.Backward(this->blob_top_vec_, propagate_down, this->blob_bottom_vec_);
+
+    Blob<Dtype> blob_in_place;
+    blob_in_place.CopyFrom(*this->blob_bottom_, false, true);
+    vector<Blob<Dtype>*> blob_in_place_vec(1, &blob_in_place);
+    NormalizationLayer<Dtype> layer_in_place(layer_param);
+    layer_in_place.SetUp(blob_in_place_vec, blob_in_place_vec);
+    layer_in_place.Forward(blob_in_place_vec, blob_in_place_vec);
+    for (int i = 0; i < this->blob_top_->count(); ++i) {
+      EXPECT_NEAR(this->blob_top_->cpu_data()[i], blob_in_place.cpu_data()[i], 1e-6);
+    }
+    caffe_copy(this->blob_top_->count(), this->blob_top_->cpu_diff(),
+        blob_in_place.mutable_cpu_diff());
+    layer_in_place.Backward(blob_in_place_vec, propagate_down, blob_in_place_vec);
+    for (int i = 0; i < this->blob_bottom_->count(); ++i) {
+      EXPECT_NEAR(this->blob_bottom_->cpu_diff()[i], blob_in_place.cpu_diff()[i], 1e-6);
+    }
+  }
+
+  // The second sample is scaled down until its squared norm is well below eps, so its
+  // gradient comes from the eps term rather than from ||x||. eps is raised from its default
+  // to keep that regime within reach of the finite differences.
+  void TestGradient(const bool across_spatial) {
+    LayerParameter layer_param;
+    layer_param.mutable_normalization_param()->set_across_spatial(across_spatial);
+    layer_param.mutable_normalization_param()->set_eps(1e-2);
+    NormalizationLayer<Dtype> layer(layer_param);
+    const int d = this->blob_bottom_->count(1);
+    caffe_scal(d, Dtype(1e-2), this->blob_bottom_->mutable_cpu_data() + d);
+    GradientChecker<Dtype> checker(1e-3, 1e-3);
+    checker.CheckGradientExhaustive(&layer, this->blob_bottom_vec_, this->blob_top_vec_);
+  }
+
+  Blob<Dtype>* const blob_bottom_;
+  Blob<Dtype>* const blob_top_;
+  vector<Blob<Dtype>*> blob_bottom_vec_;
+  vector<Blob<Dtype>*> blob_top_vec_;
+};
+
+TYPED_TEST_CASE(NormalizationLayerTest, TestDtypesAndDevices);
+
+TYPED_TEST(NormalizationLayerTest, TestForward) {
+  this->TestForward(true);
+}
+
+TYPED_TEST(NormalizationLayerTest, TestForwardPerPosition) {
+  this->TestForward(false);
+}
+
+TYPED_TEST(NormalizationLayerTest, TestInPlace) {
+  this->TestInPlace(true);
+}
+
+TYPED_TEST(NormalizationLayerTest, TestInPlacePerPosition) {
+  this->TestInPlace(false);
+}
+
+TYPED_TEST(NormalizationLayerTest, TestGradient) {
+  this->TestGradient(true);
+}
+
+TYPED_TEST(NormalizationLayerTest, TestGradientPerPosition) {
+  this->TestGradient(false);
+}
+
+}  // namespace caffe
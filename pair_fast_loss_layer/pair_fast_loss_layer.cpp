@@ -5,9 +5,74 @@
 *		   implement the adaptive margin mining method, we do not need to set the hard margin like 1 or others. we have no parameters.
 */
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #include "caffe/layers/pair_fast_loss_layer.hpp"
 
 namespace caffe {
+	/** take the k largest losses of one candidate list: nth_element on a scratch copy gives the k-th largest
+	loss, then one pass takes every larger loss and, in list order, as many equal ones as are still needed.
+	Returns the summed loss, marks the pairs with positive loss in pair_matrix and counts them in hard_cnt **/
+	template <typename Dtype>
+	static Dtype select_hard_pairs(const vector<float>& loss, const vector<int>& pair_index, int k,
+		vector<float>& scratch, Dtype* pair_matrix, int& hard_cnt)
+	{
+		const int size = loss.size();
+		k = std::min(k, size);
+		if (k <= 0) return Dtype(0);
+		float kth = 0;
+		int ties = size;
+		if (k < size) {
+			scratch.assign(loss.begin(), loss.end());
+			std::nth_element(scratch.begin(), scratch.begin() + (k - 1), scratch.end(), std::greater<float>());
+			kth = scratch[k - 1];
+			ties = k;
+			for (int i = 0; i < size; i++) {
+				if (loss[i] > kth) ties--;
+			}
+		}
+		Dtype sum(0.0);
+		for (int i = 0; i < size; i++) {
+			if (k < size) {
+				if (loss[i] < kth) continue;
+				if (loss[i] == kth) {
+					if (ties == 0) continue;
+					ties--;
+				}
+			}
+			sum += loss[i];
+			if (loss[i] > 0) {
+				hard_cnt++;
+				pair_matrix[pair_index[i]] = Dtype(1);
+			}
+		}
+		return sum;
+	}
+
+	/** group the samples by label by sorting the (label, sample) pairs: label_member lists the samples class by
+	class, in ascending label and then sample order, class c spans [label_offset[c], label_offset[c + 1]) and
+	sample_class maps every sample to its class. O(N log N) time and O(N) memory whatever the label values, and
+	the buffers are reused across iterations **/
+	template <typename Dtype>
+	void PairFastLossLayer<Dtype>::build_label_index(const Dtype* bottom_label, const int nums)
+	{
+		label_sorted.resize(nums);
+		for (int i = 0; i < nums; i++) label_sorted[i] = std::make_pair(static_cast<int>(bottom_label[i]), i);
+		std::sort(label_sorted.begin(), label_sorted.end());
+		label_offset.assign(1, 0);
+		label_member.resize(nums);
+		sample_class.resize(nums);
+		for (int r = 0; r < nums; r++) {
+			/** a new class starts wherever the label changes **/
+			if (r > 0 && label_sorted[r].first != label_sorted[r - 1].first) label_offset.push_back(r);
+			label_member[r] = label_sorted[r].second;
+			sample_class[label_sorted[r].second] = label_offset.size() - 1;
+		}
+		label_offset.push_back(nums);
+	}
+
 	template <typename Dtype>
 	void PairFastLossLayer<Dtype>::LayerSetUp(
 		const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top)
@@ -31,11 +96,20 @@ namespace caffe {
 		CHECK_EQ(bottom[1]->height(), 1);
 		CHECK_EQ(bottom[1]->width(), 1);
 		CHECK_EQ(bottom[1]->num(), bottom[0]->num());
-		/** pre-compute the distance matrix for later computation
-		pre-compute the diff matrix for convinience **/
+		/** pre-compute the distance matrix for later computation, its diff holds the
+		weighted Laplacian of the selected pairs in backward **/
 		dist_matrix.Reshape(bottom[0]->num() * bottom[0]->num(), 1, 1, 1);
 		pair_matrix.Reshape(bottom[0]->num() * bottom[0]->num(), 1, 1, 1);
-		diff_matrix.Reshape(bottom[0]->num() * bottom[0]->num(), bottom[0]->channels(), 1, 1);
+		norm_vector.Reshape(bottom[0]->num(), 1, 1, 1);
+		forward_iter = 0;
+		rank_precision = Dtype(0);
+
+		num_threads = 1;
+#ifdef _OPENMP
+		num_threads = this->layer_param_.pair_fast_loss_param().num_threads();
+		if (num_threads <= 0) num_threads = omp_get_max_threads();
+#endif
+		thread_neg_dist.resize(num_threads);
 	}
 
 	template <typename Dtype>
@@ -43,23 +117,38 @@ namespace caffe {
 		const vector<Blob<Dtype>*> & bottom, const vector<Blob<Dtype>*> & top){
 		const int channels = bottom[0]->channels();
 		const int nums = bottom[0]->num();
-		/** compute the diff_matrix and dist_matrix **/
+		/** compute the dist_matrix as ||a||^2 + ||b||^2 - 2 * a.b, the dot products of all pairs in one gemm **/
+		const Dtype* bottom_data = bottom[0]->cpu_data();
+		Dtype* dist = dist_matrix.mutable_cpu_data();
+		Dtype* sqr_norm = norm_vector.mutable_cpu_data();
+#ifdef _OPENMP
+		#pragma omp parallel for num_threads(num_threads) schedule(static)
+#endif
 		for (int i = 0; i < nums; ++i)
 		{
+			sqr_norm[i] = caffe_cpu_dot(channels, bottom_data + (i*channels), bottom_data + (i*channels));
+		}
+		caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans, nums, nums, channels, Dtype(-2),
+			bottom_data, bottom_data, Dtype(0), dist);
+		/** row i writes (i,j) and (j,i) for j > i only, so rows run in parallel without races **/
+#ifdef _OPENMP
+		#pragma omp parallel for num_threads(num_threads) schedule(static)
+#endif
+		for (int i = 0; i < nums; ++i)
+		{
+			dist[i * nums + i] = Dtype(0);
 			for (int j = i + 1; j < nums; ++j)
 			{
-				/** compute the diff matrix **/
-				caffe_sub(channels, bottom[0]->cpu_data() + (i*channels), bottom[0]->cpu_data() + (j*channels),
-					diff_matrix.mutable_cpu_data() + channels * (i * nums + j));
-				caffe_sub(channels, bottom[0]->cpu_data() + (j*channels), bottom[0]->cpu_data() + (i*channels),
-					diff_matrix.mutable_cpu_data() + channels * (j * nums + i));
-				dist_matrix.mutable_cpu_data()[i * nums + j] = caffe_cpu_dot(channels,
-					diff_matrix.cpu_data() + channels * (i * nums + j), diff_matrix.cpu_data() + channels * (i * nums + j));
-				dist_matrix.mutable_cpu_data()[j * nums + i] = dist_matrix.mutable_cpu_data()[i * nums + j];
+				/** clamp the rounding error of the expansion, close samples must not get a negative distance **/
+				dist[i * nums + j] = std::max(dist[i * nums + j] + sqr_norm[i] + sqr_norm[j], Dtype(0));
+				dist[j * nums + i] = dist[i * nums + j];
 			}
 		}
 
 		/** compute the pair_matrix to record whether the loss is 0 at position (i,j), all init as 0 **/
+#ifdef _OPENMP
+		#pragma omp parallel for num_threads(num_threads) schedule(static)
+#endif
 		for (int i = 0; i < nums; i++)
 		{
 			for (int j = i + 1; j < nums; j++)
@@ -69,10 +158,7 @@ namespace caffe {
 		}
 
 		/** the variable to record the loss and count information **/
-		Dtype loss(0.0);
 		Dtype hard_loss(0.0);
-		Dtype neg_pair_count(0.0);
-		Dtype pos_pair_count(0.0);
 		Dtype triplet_count(0.0);
 
 		Dtype correct_rank_count(0.0);
@@ -84,135 +170,155 @@ namespace caffe {
 
 		const Dtype* bottom_label = bottom[1]->cpu_data();
 
-		/** use the map to record accordding to the label info **/
-		map<int, vector<int>> label_data_map;
-		/** record the loss information into 2 vector, the pos pair loss and neg pair loss seperately **/
-		vector<pair<float, pair<int, int>>> hard_loss_pos;
-		vector<pair<float, pair<int, int>>> hard_loss_neg;
+		/** index the samples by label **/
+		build_label_index(bottom_label, nums);
 
-		int max_label = 0;
-		for (int i = 0; i < bottom[0]->num(); i++) {
-			const int label_value = static_cast<int>(bottom_label[i]);
-			if (label_value > max_label)
-				max_label = label_value;
-			if (label_data_map.count(label_value) > 0) {
-				label_data_map[label_value].push_back(i);
+		/** calculate the triplet precision: every (anchor, positive) pair counts the negatives farther from the
+		anchor than the positive. The negative distances of an anchor are sorted once and every positive is a
+		binary search, O(N^2 log N) instead of O(N^3). With precision_anchors only that many random anchors
+		are visited, with precision_interval only every K-th forward computes it at all **/
+		const int precision_interval = this->layer_param_.pair_fast_loss_param().precision_interval();
+		const int precision_anchors = this->layer_param_.pair_fast_loss_param().precision_anchors();
+		if (precision_interval <= 1 || forward_iter % precision_interval == 0)
+		{
+			/** draw the anchors up front so that the rng stays on one thread, then every anchor counts into
+			its own slot, summed in anchor order afterwards so the result does not depend on the threads **/
+			const int anchors = precision_anchors > 0 ? precision_anchors : nums;
+			precision_anchor.resize(anchors);
+			anchor_triplets.resize(anchors);
+			anchor_correct.resize(anchors);
+			for (int s = 0; s < anchors; s++)
+			{
+				precision_anchor[s] = precision_anchors > 0 ? caffe_rng_rand() % nums : s;
 			}
-			else{
-				vector<int> tmp;
-				tmp.push_back(i);
-				label_data_map[label_value] = tmp;
+#ifdef _OPENMP
+			#pragma omp parallel for num_threads(num_threads) schedule(static)
+#endif
+			for (int s = 0; s < anchors; s++)
+			{
+#ifdef _OPENMP
+				vector<Dtype>& neg_dist = thread_neg_dist[omp_get_thread_num()];
+#else
+				vector<Dtype>& neg_dist = thread_neg_dist[0];
+#endif
+				const int anc = precision_anchor[s];
+				const int c = sample_class[anc];
+				const int* same = &label_member[label_offset[c]];
+				const int same_size = label_offset[c + 1] - label_offset[c];
+				anchor_triplets[s] = 0;
+				anchor_correct[s] = 0;
+				if (same_size < 2) continue;
+				neg_dist.clear();
+				for (int n = 0; n < nums; n++)
+				{
+					if (sample_class[n] != c) neg_dist.push_back(dist[anc * nums + n]);
+				}
+				std::sort(neg_dist.begin(), neg_dist.end());
+				for (int k = 0; k < same_size; k++)
+				{
+					int pos = same[k];
+					if (pos == anc) continue;
+					anchor_triplets[s] += neg_dist.size();
+					anchor_correct[s] += neg_dist.end() - std::upper_bound(neg_dist.begin(), neg_dist.end(), dist[anc * nums + pos]);
+				}
 			}
-		}
-		/** calculate the triplet precision **/
-
-		for (auto const &ent1 : label_data_map)
-		{
-			int cur_size = label_data_map[ent1.first].size();
-			if (cur_size < 2)
+			for (int s = 0; s < anchors; s++)
 			{
-				continue;
+				triplet_count += Dtype(anchor_triplets[s]);
+				correct_rank_count += Dtype(anchor_correct[s]);
 			}
+			rank_precision = correct_rank_count / triplet_count;
+		}
+		forward_iter++;
 
-			for (int j = 0; j < cur_size - 1; j++)
+		/** record the loss information into the pos pair and neg pair candidate lists, pair (i,j) as i * nums + j with i < j.
+		Anchor row r is label_member[r]: its positives are the later members of its class span, its negatives all of
+		label_member outside that span. Every row writes its own slice of the lists, at offsets from a prefix sum of
+		the row counts, so the lists come out in the same order whatever the threads **/
+		pos_row_offset.resize(nums + 1);
+		neg_row_offset.resize(nums + 1);
+		pos_row_offset[0] = 0;
+		neg_row_offset[0] = 0;
+#ifdef _OPENMP
+		#pragma omp parallel for num_threads(num_threads) schedule(static)
+#endif
+		for (int r = 0; r < nums; r++)
+		{
+			const int anc = label_member[r];
+			const int c = sample_class[anc];
+			int pos_count = 0;
+			//only consider neg pairs
+			if (mode != 1)
 			{
-				for (int k = j + 1; k < cur_size; k++)
+				for (int j = r + 1; j < label_offset[c + 1]; j++)
 				{
-					int anc = label_data_map[ent1.first][j];
-					int pos = label_data_map[ent1.first][k];
-					for (auto const &ent2 : label_data_map)
-					{
-						if (ent1.first == ent2.first) continue;
-						int m_size = label_data_map[ent2.first].size();
-						for (int n = 0; n < m_size; n++)
-						{
-							triplet_count += Dtype(2);
-							int neg = label_data_map[ent2.first][n];
-							if (dist_matrix.cpu_data()[anc * nums + neg] > dist_matrix.cpu_data()[anc * nums + pos])   correct_rank_count += Dtype(1);
-							if (dist_matrix.cpu_data()[pos * nums + neg] > dist_matrix.cpu_data()[pos * nums + anc])   correct_rank_count += Dtype(1);
-						}
-					}
+					const Dtype loss_pos_pair = dist[anc * nums + label_member[j]];
+					if (loss_pos_pair != 0) pos_count++;
 				}
 			}
+			pos_row_offset[r + 1] = pos_count;
+			//only consider pos pairs
+			neg_row_offset[r + 1] = mode != 0 ? nums - (label_offset[c + 1] - label_offset[c]) : 0;
 		}
-
-		/** loop all the possible pair-wise dataset and triplet dataset **/
-		for (auto const &ent1 : label_data_map)
+		for (int r = 0; r < nums; r++)
 		{
-			int cur_size = label_data_map[ent1.first].size();
-			/** compute the same class pair-wise data loss **/
-			for (int i = 0; i < cur_size - 1; i++)
+			pos_row_offset[r + 1] += pos_row_offset[r];
+			neg_row_offset[r + 1] += neg_row_offset[r];
+		}
+		pos_pair_loss.resize(pos_row_offset[nums]);
+		pos_pair_index.resize(pos_row_offset[nums]);
+		neg_pair_loss.resize(neg_row_offset[nums]);
+		neg_pair_index.resize(neg_row_offset[nums]);
+#ifdef _OPENMP
+		#pragma omp parallel for num_threads(num_threads) schedule(static)
+#endif
+		for (int r = 0; r < nums; r++)
+		{
+			const int anc = label_member[r];
+			const int c = sample_class[anc];
+			/** compute the same class pair-wise data loss, over the same pairs and with the same zero test as the
+			count pass, so that the row fills exactly its slice **/
+			if (mode != 1)
 			{
-				//only consider neg pairs
-				if (mode == 1) continue;
-				for (int j = i + 1; j < cur_size; j++)
+				int out = pos_row_offset[r];
+				for (int j = r + 1; j < label_offset[c + 1]; j++)
 				{
-					int pos_1 = label_data_map[ent1.first][i];
-					int pos_2 = label_data_map[ent1.first][j];
-					float loss_pos_pair = dist_matrix.cpu_data()[pos_1 * nums + pos_2];
-					//float loss_pos_pair = max(dist_matrix.cpu_data()[pos_1 * nums + pos_2] - min_dist_class[ent1.first], Dtype(0.0));
+					int pos = label_member[j];
+					const Dtype loss_pos_pair = dist[anc * nums + pos];
 					if (loss_pos_pair == 0) continue;
-					pos_pair_count += Dtype(1);
-					float tmp_pos_pair = loss_pos_pair;
-					if (pos_1 < pos_2)	hard_loss_pos.push_back(std::make_pair(tmp_pos_pair, std::make_pair(pos_1, pos_2)));
-					else hard_loss_pos.push_back(std::make_pair(tmp_pos_pair, std::make_pair(pos_2, pos_1)));
-					loss += loss_pos_pair;
+					pos_pair_loss[out] = loss_pos_pair;
+					pos_pair_index[out] = std::min(anc, pos) * nums + std::max(anc, pos);
+					out++;
 				}
 			}
-			/** compute the different class pair-wise data loss **/
-			for (int i = 0; i < cur_size; i++)
+			/** compute the different class pair-wise data loss, every sample outside the class span **/
+			if (mode != 0)
 			{
-				//only consider pos pairs
-				if (mode == 0) continue;
-				int index_candidate = -1;
-				for (auto const &ent2 : label_data_map)
+				int out = neg_row_offset[r];
+				for (int j = 0; j < nums; j++)
 				{
-					//Dtype cur_margin = max(max_dist_class[ent1.first], max_dist_class[ent2.first]);
-					index_candidate++;
-					if (ent1.first == ent2.first) continue;
-					int neg_size = label_data_map[ent2.first].size();
-					for (int j = 0; j < neg_size; j++)
-					{
-						neg_pair_count += Dtype(1);
-						int pos = label_data_map[ent1.first][i];
-						int neg = label_data_map[ent2.first][j];
-						Dtype loss_pos_neg = std::max(margin - dist_matrix.cpu_data()[pos * nums + neg], Dtype(0.0));
-						float tmp_neg_pair = factor * loss_pos_neg;
-						if (pos < neg)  hard_loss_neg.push_back(std::make_pair(tmp_neg_pair, std::make_pair(pos, neg)));
-						else hard_loss_neg.push_back(std::make_pair(tmp_neg_pair, std::make_pair(neg, pos)));
-						loss += tmp_neg_pair;
-					}
+					if (j == label_offset[c]) j = label_offset[c + 1];
+					if (j == nums) break;
+					int neg = label_member[j];
+					Dtype loss_pos_neg = std::max(margin - dist[anc * nums + neg], Dtype(0.0));
+					neg_pair_loss[out] = factor * loss_pos_neg;
+					neg_pair_index[out] = std::min(anc, neg) * nums + std::max(anc, neg);
+					out++;
 				}
 			}
 		}
-		/** sort all the hard sample set **/
-		if (hard_ratio < 1) {
-			sort(hard_loss_pos.begin(), hard_loss_pos.end(), [](const pair<float, pair<int, int>>& a, const pair<float, pair<int, int>>& b)
-			{	return a.first > b.first; });
-			sort(hard_loss_neg.begin(), hard_loss_neg.end(), [](const pair<float, pair<int, int>>& a, const pair<float, pair<int, int>>& b)
-			{	return a.first > b.first; });
-		}
-
+		const int pos_pair_count = pos_pair_loss.size();
+		const int neg_pair_count = neg_pair_loss.size();
+		/** select the hardest hard_ratio of each set, no sort needed since only the sum and the pairs count **/
 		int pos_hard_cnt = pos_pair_count * hard_ratio;
 		int neg_hard_cnt = neg_pair_count * hard_ratio;
-		for (int i = 0; i < pos_hard_cnt; i++)  hard_loss += hard_loss_pos[i].first;
-		for (int i = 0; i < neg_hard_cnt; i++)  hard_loss += hard_loss_neg[i].first;
-
 		int all_hard_cnt = 0;
-		for (int i = 0; i < pos_hard_cnt; i++) {
-			if (hard_loss_pos[i].first > 0) {
-				all_hard_cnt++;
-				pair_matrix.mutable_cpu_data()[hard_loss_pos[i].second.first * nums + hard_loss_pos[i].second.second] = Dtype(1);
-			}
-		}
-		for (int i = 0; i < neg_hard_cnt; i++) {
-			if (hard_loss_neg[i].first > 0) {
-				all_hard_cnt++;
-				pair_matrix.mutable_cpu_data()[hard_loss_neg[i].second.first * nums + hard_loss_neg[i].second.second] = Dtype(1);
-			}
-		}
+		hard_loss += select_hard_pairs(pos_pair_loss, pos_pair_index, pos_hard_cnt, select_buffer,
+			pair_matrix.mutable_cpu_data(), all_hard_cnt);
+		hard_loss += select_hard_pairs(neg_pair_loss, neg_pair_index, neg_hard_cnt, select_buffer,
+			pair_matrix.mutable_cpu_data(), all_hard_cnt);
 		hard_loss = hard_loss / all_hard_cnt;
-		triplet_rank_precision = correct_rank_count / triplet_count;
+		triplet_rank_precision = rank_precision;
 
 		top[0]->mutable_cpu_data()[0] = hard_loss;
 		top[1]->mutable_cpu_data()[0] = triplet_rank_precision;
@@ -226,7 +332,6 @@ namespace caffe {
 		Dtype factor = this->layer_param_.pair_fast_loss_param().factor();
 		const int channels = bottom[0]->channels();
 		const int nums = bottom[0]->num();
-		const int count = bottom[0]->count();
 
 		if (propagate_down[1])
 		{
@@ -234,56 +339,37 @@ namespace caffe {
 				<< " Layer cannot backpropagate to label inputs.";
 		}
 
-		Dtype* bout = bottom[0]->mutable_cpu_diff();
-		for (int i = 0; i < count; i++)
-		{
-			bout[i] = 0;
-		}
-
 		if (propagate_down[0])
 		{
+			/** a selected pair (i,j) of weight w adds w * (x_i - x_j) to the diff of i and w * (x_j - x_i) to
+			the diff of j, so the whole gradient is L * X with L the weighted Laplacian of the selected pairs,
+			w = alpha for a positive pair and -factor * alpha for a negative one **/
+			/** each thread owns whole rows of L: row i reads the flag of (i,j) from the upper triangle of
+			pair_matrix and sums its diagonal in j order, so L does not depend on the threads **/
+			Dtype* laplacian = dist_matrix.mutable_cpu_diff();
+			const Dtype* flag = pair_matrix.cpu_data();
+			const Dtype* bottom_label = bottom[1]->cpu_data();
+#ifdef _OPENMP
+			#pragma omp parallel for num_threads(num_threads) schedule(static)
+#endif
 			for (int i = 0; i < nums; i++)
 			{
-				for (int j = i + 1; j < nums; j++)
+				Dtype* row = laplacian + i * nums;
+				row[i] = Dtype(0);
+				for (int j = 0; j < nums; j++)
 				{
-					if (pair_matrix.mutable_cpu_data()[i * nums + j] == Dtype(1))
+					if (j == i) continue;
+					row[j] = Dtype(0);
+					if (flag[std::min(i, j) * nums + std::max(i, j)] == Dtype(1))
 					{
-						// postive pair gradient update
-						if ((bottom[1]->cpu_data()[i] == bottom[1]->cpu_data()[j]))
-						{
-							//Dtype loss_factor =  dist_matrix.cpu_data()[i * nums + j];
-							caffe_cpu_axpby(
-								channels,
-								alpha,
-								diff_matrix.cpu_data() + channels * (i * nums + j),
-								Dtype(1),
-								bout + (i*channels));
-							caffe_cpu_axpby(
-								channels,
-								alpha,
-								diff_matrix.cpu_data() + channels * (j * nums + i),
-								Dtype(1),
-								bout + (j*channels));
-						}
-						else
-						{
-							//Dtype loss_factor = abs(2 - dist_matrix.cpu_data()[i * nums + j]);
-							caffe_cpu_axpby(
-								channels,
-								factor * alpha,
-								diff_matrix.cpu_data() + channels * (j * nums + i),
-								Dtype(1),
-								bout + (i*channels));
-							caffe_cpu_axpby(
-								channels,
-								factor * alpha,
-								diff_matrix.cpu_data() + channels * (i * nums + j),
-								Dtype(1),
-								bout + (j*channels));
-						}
+						Dtype w = (bottom_label[i] == bottom_label[j]) ? alpha : -factor * alpha;
+						row[j] -= w;
+						row[i] += w;
 					}
 				}
 			}
+			caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, nums, channels, nums, Dtype(1),
+				laplacian, bottom[0]->cpu_data(), Dtype(0), bottom[0]->mutable_cpu_diff());
 		}
 	}
 #ifdef CPU_ONLY
@@ -8,6 +8,8 @@
 
 #include <vector>
 #include <algorithm>
+#include <functional>
+#include <utility>
 #include "caffe/blob.hpp"
 #include "caffe/layer.hpp"
 #include "caffe/proto/caffe.pb.h"
@@ -42,9 +44,31 @@ namespace caffe {
 		virtual void Backward_gpu(const vector<Blob<Dtype>*>& top, const vector<bool>& propagate_down,
 			const vector<Blob<Dtype>*>& bottom);
 
+		void build_label_index(const Dtype* bottom_label, const int nums);
+
 		Blob<Dtype> dist_matrix;
-		Blob<Dtype> diff_matrix;
 		Blob<Dtype> pair_matrix;
+		Blob<Dtype> norm_vector;  // squared norm of every sample
+		/** hard mining candidates, kept across iterations so that steady-state forward does not allocate **/
+		vector<float> pos_pair_loss;
+		vector<int> pos_pair_index;
+		vector<float> neg_pair_loss;
+		vector<int> neg_pair_index;
+		vector<float> select_buffer;
+		/** CSR label index: samples class by class in label_member, class c at [label_offset[c], label_offset[c + 1]) **/
+		vector<int> label_offset;
+		vector<int> label_member;
+		vector<int> sample_class;
+		vector<std::pair<int, int> > label_sorted;  // (label, sample) pairs in sorted order
+		vector<int> pos_row_offset;  // start of every anchor row in the pos / neg candidate lists
+		vector<int> neg_row_offset;
+		vector<int> precision_anchor;  // anchors of the rank precision, with their triplet and correct counts
+		vector<int> anchor_triplets;
+		vector<int> anchor_correct;
+		vector<vector<Dtype> > thread_neg_dist;  // per thread sorted negative distances of one anchor
+		int num_threads;  // threads used by the CPU implementation
+		int forward_iter;
+		Dtype rank_precision;  // last computed triplet rank precision, reported between precision_interval updates
 		PairFastLossParameter param_;
 
 		//map<int, Dtype> max_dist_class;
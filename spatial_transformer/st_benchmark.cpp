@@ -0,0 +1,226 @@
+// Micro-benchmark of the SpatialTransformer CPU paths, built as a caffe tool:
+//   cp spatial_transformer/st_benchmark.cpp $CAFFE_HOME/tools/
+//   st_benchmark --mode=channels_last --iterations=5 --num_threads=1
+//   st_benchmark --mode=tiled --iterations=3 --num_threads=1
+// Every row reports the mean time of one pass over --iterations runs, after one warm-up.
+// Cache misses come from the perf_event cache-misses counter of the calling thread, so
+// they cover the whole pass only with --num_threads=1, and read n/a where perf events are
+// not available (e.g. perf_event_paranoid, containers).
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <gflags/gflags.h>
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/layers/st_layer.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/math_functions.hpp"
+
+using caffe::Blob;
+using caffe::LayerParameter;
+using caffe::SpatialTransformerLayer;
+using std::string;
+using std::vector;
+
+DEFINE_string(mode, "channels_last",
+    "channels_last: NCHW against channels-last sampling over channel counts, "
+    "tiled: row order against tiled sampling over image sizes and rotations");
+DEFINE_int32(iterations, 5, "timed passes per configuration");
+DEFINE_int32(num_threads, 1, "st_param num_threads, 0 for the OpenMP default");
+
+// hardware cache misses between Start and Stop, -1 when the counter cannot be opened
+class CacheMisses {
+ public:
+  CacheMisses() : fd_(-1), count_(-1) {
+#ifdef __linux__
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd_ = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+  }
+  ~CacheMisses() {
+#ifdef __linux__
+    if (fd_ >= 0) close(fd_);
+#endif
+  }
+  void Start() {
+#ifdef __linux__
+    if (fd_ < 0) return;
+    ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+  }
+  void Stop() {
+#ifdef __linux__
+    if (fd_ < 0) return;
+    ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+    long long count;
+    if (read(fd_, &count, sizeof(count)) == sizeof(count)) count_ = count;
+#endif
+  }
+  long long count() const { return count_; }
+
+ private:
+  int fd_;
+  long long count_;
+};
+
+// one layer instance with its bottoms: N images of C x size x size, each rotated by angle
+// degrees and scaled by zoom
+class StBench {
+ public:
+  StBench(const LayerParameter& param, const int N, const int C, const int size,
+      const double angle, const double zoom)
+      : U_(N, C, size, size) {
+    float* U = U_.mutable_cpu_data();
+    for (int i = 0; i < U_.count(); ++i) {
+      U[i] = std::sin(i * 0.013f);
+    }
+    vector<int> theta_shape(2);
+    theta_shape[0] = N;
+    theta_shape[1] = 6;
+    theta_.Reshape(theta_shape);
+    float* theta = theta_.mutable_cpu_data();
+    const double a = angle * M_PI / 180;
+    for (int i = 0; i < N; ++i) {
+      theta[6 * i + 0] = zoom * std::cos(a);
+      theta[6 * i + 1] = -zoom * std::sin(a);
+      theta[6 * i + 2] = 0.01f * i;
+      theta[6 * i + 3] = zoom * std::sin(a);
+      theta[6 * i + 4] = zoom * std::cos(a);
+      theta[6 * i + 5] = -0.01f * i;
+    }
+    bottom_.push_back(&U_);
+    bottom_.push_back(&theta_);
+    top_.push_back(&V_);
+    layer_.reset(new SpatialTransformerLayer<float>(param));
+    layer_->SetUp(bottom_, top_);
+  }
+
+  // mean milliseconds of a forward pass, or of forward + backward, and when misses is
+  // given the mean cache misses of one pass (-1 without a counter)
+  float Time(const bool backward, long long* misses = NULL) {
+    caffe::CPUTimer timer;
+    CacheMisses counter;
+    Pass(backward);
+    timer.Start();
+    counter.Start();
+    for (int i = 0; i < FLAGS_iterations; ++i) {
+      Pass(backward);
+    }
+    counter.Stop();
+    timer.Stop();
+    if (misses) {
+      *misses = counter.count() < 0 ? -1 : counter.count() / FLAGS_iterations;
+    }
+    return timer.MilliSeconds() / FLAGS_iterations;
+  }
+
+ private:
+  void Pass(const bool backward) {
+    layer_->Forward(bottom_, top_);
+    if (!backward) return;
+    caffe::caffe_set(V_.count(), 1.f, V_.mutable_cpu_diff());
+    layer_->Backward(top_, vector<bool>(2, true), bottom_);
+  }
+
+  Blob<float> U_, theta_, V_;
+  vector<Blob<float>*> bottom_, top_;
+  boost::shared_ptr<SpatialTransformerLayer<float> > layer_;
+};
+
+static LayerParameter st_param(const bool train) {
+  LayerParameter param;
+  param.set_phase(train ? caffe::TRAIN : caffe::TEST);
+  param.mutable_st_param()->set_num_threads(FLAGS_num_threads);
+  param.mutable_st_param()->set_forward_only(!train);
+  return param;
+}
+
+// NCHW reads one plane per channel and tap, channels_last one contiguous pixel per tap
+// but transposes U and V (and their diffs) on the way in and out. Backward is reported as
+// the forward + backward time minus the forward time.
+static void bench_channels_last() {
+  const int shapes[][3] = {{4, 3, 128}, {4, 64, 64}, {4, 256, 32}};
+  printf("rot 30, ms per pass\n");
+  printf("%-20s %10s %10s %10s %10s\n", "N x C x H x W", "nchw fwd", "nchw bwd",
+      "nhwc fwd", "nhwc bwd");
+  for (int i = 0; i < 3; ++i) {
+    const int N = shapes[i][0], C = shapes[i][1], size = shapes[i][2];
+    float ms[4];
+    for (int layout = 0; layout < 2; ++layout) {
+      LayerParameter param = st_param(true);
+      param.mutable_st_param()->set_channels_last(layout == 1);
+      const float forward = StBench(param, N, C, size, 30, 1.).Time(false);
+      const float both = StBench(param, N, C, size, 30, 1.).Time(true);
+      ms[2 * layout] = forward;
+      ms[2 * layout + 1] = both - forward;
+    }
+    char shape[32];
+    snprintf(shape, sizeof(shape), "%d x %d x %d x %d", N, C, size, size);
+    printf("%-20s %10.2f %10.2f %10.2f %10.2f\n", shape, ms[0], ms[1], ms[2], ms[3]);
+  }
+}
+
+static string misses_string(const long long misses) {
+  char buffer[32];
+  if (misses < 0) return "n/a";
+  snprintf(buffer, sizeof(buffer), "%.2fM", misses / 1e6);
+  return buffer;
+}
+
+// forward in output row order against output tiles (auto tile size) for large inputs under
+// rotation: rows of V walk diagonally across U, tiles keep their source footprint in L2
+static void bench_tiled() {
+  const int C = 8;
+  const int angles[] = {0, 15, 30, 45};
+  printf("N=1 C=%d forward_only, ms per pass (cache misses per pass)\n", C);
+  printf("%-10s %4s %22s %22s\n", "size", "rot", "row order", "tiled");
+  for (int size = 512; size <= 2048; size *= 2) {
+    for (int a = 0; a < 4; ++a) {
+      LayerParameter rows = st_param(false), tiles = st_param(false);
+      tiles.mutable_st_param()->set_tiled(true);
+      long long row_misses, tile_misses;
+      const float row_ms =
+          StBench(rows, 1, C, size, angles[a], 1.).Time(false, &row_misses);
+      const float tile_ms =
+          StBench(tiles, 1, C, size, angles[a], 1.).Time(false, &tile_misses);
+      char shape[32];
+      snprintf(shape, sizeof(shape), "%dx%d", size, size);
+      printf("%-10s %4d %12.1f (%7s) %12.1f (%7s)\n", shape, angles[a], row_ms,
+          misses_string(row_misses).c_str(), tile_ms, misses_string(tile_misses).c_str());
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  gflags::SetUsageMessage("st_benchmark --mode=channels_last|tiled");
+  caffe::GlobalInit(&argc, &argv);
+  if (FLAGS_mode == "channels_last") {
+    bench_channels_last();
+  } else if (FLAGS_mode == "tiled") {
+    bench_tiled();
+  } else {
+    LOG(ERROR) << "Unknown mode " << FLAGS_mode;
+    return 1;
+  }
+  return 0;
+}
@@ -5,12 +5,37 @@
 #include <glog/logging.h>
 
 #include <cmath>
+#include <limits>
+#include <stdint.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
 
 #include "caffe/blob.hpp"
 #include "caffe/common.hpp"
 #include "caffe/layers/st_layer.hpp"
 #include "caffe/util/math_functions.hpp"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define ST_SIMD_DISPATCH
+#endif
+
+// Keeps weight * u + res unfused in the sampling kernels. With -march=native (or any -mfma)
+// GCC contracts it into an FMA, which rounds once instead of twice, so the scalar and the
+// vector kernels would no longer agree bit for bit. Clang only contracts within one
+// expression and takes #pragma clang fp contract(off) in the scalar kernel instead.
+#if defined(__GNUC__) && !defined(__clang__)
+#define ST_NO_FP_CONTRACT __attribute__((optimize("fp-contract=off")))
+#else
+#define ST_NO_FP_CONTRACT
+#endif
+
 namespace caffe {
 
 template <typename Dtype>
@@ -26,15 +51,32 @@ void SpatialTransformerLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bott
 	}
 
 	if(this->layer_param_.st_param().sampler_type() == "bilinear") {
-		sampler_type_ = "bilinear";
+		sampler_ = BILINEAR;
+	} else if(this->layer_param_.st_param().sampler_type() == "nearest") {
+		sampler_ = NEAREST;
 	} else {
-		CHECK(false) << prefix << "Sampler type only supports bilinear now!" << std::endl;
+		CHECK(false) << prefix << "Sampler type only supports bilinear and nearest now!" << std::endl;
 	}
 
 	if(this->layer_param_.st_param().to_compute_du()) {
 		to_compute_dU_ = true;
 	}
 
+	// forward_only is an explicit opt-in: TEST phase nets may still back-propagate
+	// (force_backward, input gradients), so the phase alone keeps every buffer
+	inference_ = this->layer_param_.st_param().forward_only();
+	std::cout<<prefix<<"inference_ = "<<inference_<<std::endl;
+
+	channels_last_ = this->layer_param_.st_param().channels_last();
+	std::cout<<prefix<<"channels_last_ = "<<channels_last_<<std::endl;
+
+	num_threads_ = 1;
+#ifdef _OPENMP
+	num_threads_ = this->layer_param_.st_param().num_threads();
+	if(num_threads_ <= 0) num_threads_ = omp_get_max_threads();
+#endif
+	std::cout<<prefix<<"num_threads_ = "<<num_threads_<<std::endl;
+
 	std::cout<<prefix<<"Getting output_H_ and output_W_"<<std::endl;
 
 	output_H_ = bottom[0]->shape(2);
@@ -98,39 +140,42 @@ void SpatialTransformerLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bott
 		std::cout<<prefix<<"Getting pre-defined theta[2][3] = "<<pre_defined_theta[5]<<std::endl;
 	}
 
-	// check the validation for the parameter theta
-	CHECK(bottom[1]->count(1) + pre_defined_count == 6) << "The dimension of theta is not six!"
-			<< " Only " << bottom[1]->count(1) << " + " << pre_defined_count << std::endl;
-	CHECK(bottom[1]->shape(0) == bottom[0]->shape(0)) << "The first dimension of theta and " <<
-			"U should be the same (batch size)" << std::endl;
+	// theta_1_2 = theta_2_1 = 0 only scales and translates: sample rows and columns separately
+	separable_ = !channels_last_ && is_pre_defined_theta[1] && pre_defined_theta[1] == 0
+			&& is_pre_defined_theta[3] && pre_defined_theta[3] == 0;
+	std::cout<<prefix<<"separable_ = "<<separable_<<std::endl;
 
-	// initialize the matrix for output grid (x_i, y_i, 1.0)
-  // the same matrix [-1,1] by [-1,1] for all batch elements
-	std::cout<<prefix<<"Initializing the matrix for output grid"<<std::endl;
+	// tiles only reorder the 2-D NCHW plan, the other paths already read U row by row
+	tiled_ = this->layer_param_.st_param().tiled() && !separable_ && !channels_last_;
+	tile_size_ = this->layer_param_.st_param().tile_size();
+	std::cout<<prefix<<"tiled_ = "<<tiled_<<", tile_size_ = "<<tile_size_<<std::endl;
 
-	vector<int> shape_output(2);
-	shape_output[0] = output_H_ * output_W_;
-  shape_output[1] = 3;
-	output_grid.Reshape(shape_output);
+	// check the validation for the parameter theta: 6 - pre_defined_count values per transform,
+	// over all the axes after the first (N x P, N x P x 1 x 1, ...) or, for several crops per
+	// image, the last one of N x crops x P
+	const int theta_count = theta_has_crops_axis(bottom[1]) ? bottom[1]->shape(2) : bottom[1]->count(1);
+	CHECK(theta_count + pre_defined_count == 6) << "The dimension of theta is not six!"
+			<< " Only " << theta_count << " + " << pre_defined_count << std::endl;
 
-	Dtype* data = output_grid.mutable_cpu_data();
-	for(int i=0; i< output_H_ * output_W_; ++i) {
-		data[3 * i] = (i / output_W_) * 1.0 / output_H_ * 2 - 1;
-		data[3 * i + 1] = (i % output_W_) * 1.0 / output_W_ * 2 - 1;
-		data[3 * i + 2] = 1;
+	// initialize the matrix for output grid (x_i, y_i, 1.0)
+  // the same matrix [-1,1] by [-1,1] for all batch elements. The 2-D inference path computes
+  // these coordinates on the fly (build_block_plan) and does not keep the matrix.
+	if(!inference_ || separable_) {
+		std::cout<<prefix<<"Initializing the matrix for output grid"<<std::endl;
+
+		vector<int> shape_output(2);
+		shape_output[0] = output_H_ * output_W_;
+		shape_output[1] = 3;
+		output_grid.Reshape(shape_output);
+
+		Dtype* data = output_grid.mutable_cpu_data();
+		for(int i=0; i< output_H_ * output_W_; ++i) {
+			data[3 * i] = (i / output_W_) * 1.0 / output_H_ * 2 - 1;
+			data[3 * i + 1] = (i % output_W_) * 1.0 / output_W_ * 2 - 1;
+			data[3 * i + 2] = 1;
+		}
 	}
 
-	// initialize the matrix for input grid
-  // the input grid gives, for (i,j) in the output, the corresponding position (projection)
-  // on the input
-	std::cout<<prefix<<"Initializing the matrix for input grid"<<std::endl;
-
-	vector<int> shape_input(3);
-	shape_input[0] = bottom[1]->shape(0);
-  shape_input[1] = output_H_ * output_W_;
-  shape_input[2] = 2;
-	input_grid.Reshape(shape_input);
-
 	std::cout<<prefix<<"Initialization finished."<<std::endl;
 }
 
@@ -142,7 +187,28 @@ void SpatialTransformerLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
 
 	if(global_debug) std::cout<<prefix<<"Starting!"<<std::endl;
 
-	N = bottom[0]->shape(0);
+	// theta holds crops_ transforms per image of U, either as N x crops_ x P or as (N * crops_) x P
+	// (any trailing axes of size 1 included) with the crops of an image consecutive. Every crop
+	// reads the image it belongs to.
+	int crops;
+	if(theta_has_crops_axis(bottom[1])) {
+		CHECK(bottom[1]->shape(0) == bottom[0]->shape(0)) << prefix << "The first dimension of "
+				<< "theta and U should be the same (batch size)" << std::endl;
+		crops = bottom[1]->shape(1);
+	} else {
+		CHECK(bottom[1]->shape(0) % bottom[0]->shape(0) == 0) << prefix << "The first dimension "
+				<< "of theta should be a multiple of the batch size of U" << std::endl;
+		crops = bottom[1]->shape(0) / bottom[0]->shape(0);
+	}
+
+	// Reshape runs before every forward pass, only a new geometry invalidates the cached plan
+	if(bottom[0]->shape(0) * crops != N || bottom[0]->shape(2) != H || bottom[0]->shape(3) != W) {
+		plan_valid_ = false;
+	}
+
+	// from here on N counts transforms (images of V), N / crops_ is the number of images of U
+	crops_ = crops;
+	N = bottom[0]->shape(0) * crops_;
 	C = bottom[0]->shape(1);
 	H = bottom[0]->shape(2);
 	W = bottom[0]->shape(3);
@@ -159,90 +225,1220 @@ void SpatialTransformerLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
 
 	top[0]->Reshape(shape);
 
-	// reshape dTheta_tmp
-	vector<int> dTheta_tmp_shape(4);
+	// taps per output pixel of the 2-D plan, and per axis of the separable plan
+	const int taps = (sampler_ == NEAREST) ? 1 : 4;
+	const int taps_1d = (sampler_ == NEAREST) ? 1 : 2;
 
-	dTheta_tmp_shape[0] = N;
-	dTheta_tmp_shape[1] = 2;
-	dTheta_tmp_shape[2] = 3;
-	dTheta_tmp_shape[3] = output_H_ * output_W_ * C;
+	if(separable_) {
 
-	dTheta_tmp.Reshape(dTheta_tmp_shape);
+		// 1-D row and column tables, one set per image
+		vector<int> table_shape(2);
+		table_shape[0] = N;
+		table_shape[1] = taps_1d * (output_H_ + output_W_);
+		sep_index_.Reshape(table_shape);
+		sep_weight_.Reshape(table_shape);
+		sep_sign_.Reshape(table_shape);
 
-	// init all_ones_2
-	vector<int> all_ones_2_shape(1);
-	all_ones_2_shape[0] = output_H_ * output_W_ * C;
-	all_ones_2.Reshape(all_ones_2_shape);
+		// per-thread column passes: T for the forward pass, T, G and dT for the backward pass
+		sep_buffer_.Reshape(num_threads_, inference_ ? 1 : 3, H, output_W_);
+
+		if(!inference_ && sampler_ == BILINEAR) {
+			sep_theta_partial_.Reshape(N, C, output_H_ + output_W_, 1);
+		}
+	} else if(!inference_) {
+		// reshape the sampling plan, one per image. In inference mode the samplers build the plan
+		// of a row or tile at a time instead, and nothing that only serves the backward pass is
+		// allocated (see build_sampling_grid).
+		vector<int> plan_shape(3);
+		plan_shape[0] = N;
+		plan_shape[1] = taps;
+		plan_shape[2] = output_H_ * output_W_;
+		plan_offset_.Reshape(plan_shape);
+		plan_weight_.Reshape(plan_shape);
+
+		// reshape the matrix for input grid
+	  // the input grid gives, for (i,j) in the output, the corresponding position (projection)
+	  // on the input. It is stored pixel-major (output_H_ * output_W_) x N x 2 so that the whole
+	  // batch is one GEMM against the N stacked thetas.
+		vector<int> shape_input(3);
+		shape_input[0] = output_H_ * output_W_;
+		shape_input[1] = N;
+		shape_input[2] = 2;
+		input_grid.Reshape(shape_input);
+
+		// reshape dTheta_tmp
+		vector<int> dTheta_tmp_shape(4);
+
+		dTheta_tmp_shape[0] = N;
+		dTheta_tmp_shape[1] = 2;
+		dTheta_tmp_shape[2] = 3;
+		dTheta_tmp_shape[3] = output_H_ * output_W_ * C;
+
+		dTheta_tmp.Reshape(dTheta_tmp_shape);
+
+		// init all_ones_2
+		vector<int> all_ones_2_shape(1);
+		all_ones_2_shape[0] = output_H_ * output_W_ * C;
+		all_ones_2.Reshape(all_ones_2_shape);
+
+		// nearest sampling is piecewise constant in (px, py) and has no gradient plan
+		if(sampler_ == BILINEAR) {
+			plan_shape[1] = 4 * 2;
+			plan_grad_.Reshape(plan_shape);
+		}
+	}
+
+	// NHWC copies of U / dU and V / dV for the channels-last path
+	if(channels_last_) {
+		U_nhwc_.Reshape(N / crops_, H, W, C);
+		V_nhwc_.Reshape(N, output_H_, output_W_, C);
+	}
 
 	// reshape full_theta
 	vector<int> full_theta_shape(2);
 	full_theta_shape[0] = N;
 	full_theta_shape[1] = 6;
 	full_theta.Reshape(full_theta_shape);
+	plan_theta_.Reshape(full_theta_shape);
 
 	if(global_debug) std::cout<<prefix<<"Finished."<<std::endl;
 }
 
+// Sampling of `count` consecutive output pixels from one channel `pic` using a tap-major
+// plan (tap k of pixel t at offset[k * stride + t]), TAPS = 4 for bilinear and 1 for nearest.
+// The taps are accumulated in the same order everywhere, and no kernel contracts the
+// multiply-add (ST_NO_FP_CONTRACT), so the scalar and the SIMD kernels give identical results.
+template <int TAPS, typename Dtype>
+ST_NO_FP_CONTRACT
+static void sample_plan_scalar(const int* offset, const Dtype* weight, const int stride,
+		const Dtype* pic, Dtype* V, const int begin, const int count) {
+#ifdef __clang__
+	#pragma clang fp contract(off)
+#endif
+	for(int t = begin; t < count; ++t) {
+		Dtype res = (Dtype)0.;
+		for(int k = 0; k < TAPS; ++k) {
+			res += weight[k * stride + t] * pic[offset[k * stride + t]];
+		}
+		V[t] = res;
+	}
+}
+
+#ifdef ST_SIMD_DISPATCH
+// 8 output pixels per iteration with AVX2 gathers. Out-of-range taps were clamped to
+// offset 0 / weight 0 when the plan was built, so the gathers need no mask.
+template <int TAPS>
+__attribute__((target("avx2"))) ST_NO_FP_CONTRACT
+static int sample_plan_avx2(const int* offset, const float* weight, const int stride,
+		const float* pic, float* V, const int count) {
+	int t = 0;
+	for(; t + 8 <= count; t += 8) {
+		__m256 res = _mm256_setzero_ps();
+		for(int k = 0; k < TAPS; ++k) {
+			const __m256i idx = _mm256_loadu_si256(
+					reinterpret_cast<const __m256i*>(offset + k * stride + t));
+			const __m256 u = _mm256_i32gather_ps(pic, idx, 4);
+			res = _mm256_add_ps(res, _mm256_mul_ps(_mm256_loadu_ps(weight + k * stride + t), u));
+		}
+		_mm256_storeu_ps(V + t, res);
+	}
+	return t;
+}
+
+// 16 output pixels per iteration with AVX-512 gathers. The *_round_ps forms keep the
+// compiler from contracting mul + add into an FMA, which would round differently. The
+// masked forms with an all-ones mask take a zero pass-through operand, where the unmasked
+// ones pass an undefined register that GCC reports as maybe-uninitialized.
+template <int TAPS>
+__attribute__((target("avx512f")))
+static int sample_plan_avx512(const int* offset, const float* weight, const int stride,
+		const float* pic, float* V, const int count) {
+	const __mmask16 all = 0xFFFF;
+	int t = 0;
+	for(; t + 16 <= count; t += 16) {
+		__m512 res = _mm512_setzero_ps();
+		for(int k = 0; k < TAPS; ++k) {
+			const __m512i idx = _mm512_loadu_si512(offset + k * stride + t);
+			const __m512 u = _mm512_mask_i32gather_ps(_mm512_setzero_ps(), all, idx, pic, 4);
+			res = _mm512_maskz_add_round_ps(all, res, _mm512_maskz_mul_round_ps(all,
+					_mm512_loadu_ps(weight + k * stride + t), u, _MM_FROUND_CUR_DIRECTION),
+					_MM_FROUND_CUR_DIRECTION);
+		}
+		_mm512_storeu_ps(V + t, res);
+	}
+	return t;
+}
+
+enum SimdLevel { SIMD_NONE, SIMD_AVX2, SIMD_AVX512 };
+
+static SimdLevel detect_simd_level() {
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512f")) return SIMD_AVX512;
+	if(__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+	return SIMD_NONE;
+}
+#endif
+
+// cap set by SpatialTransformerLayer::set_max_simd_level, the widest unit by default
+static int max_simd_level = 2;
+
 template <typename Dtype>
-Dtype SpatialTransformerLayer<Dtype>::transform_forward_cpu(const Dtype* pic, Dtype px, Dtype py) {
-
-	bool debug = false;
-	string prefix = "\t\tSpatial Transformer Layer:: transform_forward_cpu: \t";
-	if(debug) std::cout<<prefix<<"Starting!\t"<<std::endl;
-	if(debug) std::cout<<prefix<<"(px, py) = ("<<px<<", "<<py<<")"<<std::endl;
-
-	Dtype res = (Dtype)0.;
-
-  // calcul de x,y (position dans l'image)
-	Dtype x = (px + 1) / 2 * H;
-  Dtype y = (py + 1) / 2 * W;
-	if(debug) std::cout<<prefix<<"(x, y) = ("<<x<<", "<<y<<")"<<std::endl;
-
-  for(int m = floor(x); m <= ceil(x); ++m)
-    for(int n = floor(y); n <= ceil(y); ++n) {
-      if(debug) std::cout<<prefix<<"- (m, n) = ("<<m<<", "<<n<<")"<<std::endl;
-      if(m >= 0 && m < H && n >= 0 && n < W) {
-        res += (1 - abs(x - m)) * (1 - abs(y - n)) * pic[m * W + n];
-        if(debug) std::cout<<prefix<<" pic[m, n] = "<<pic[m * W + n]<<std::endl;
-      }
-    }
+void SpatialTransformerLayer<Dtype>::set_max_simd_level(const int level) {
+	max_simd_level = level;
+}
 
-	if(debug) std::cout<<prefix<<"Finished. \tres = "<<res<<std::endl;
+template <int TAPS, typename Dtype>
+static void sample_plan_cpu(const int* offset, const Dtype* weight, const int stride,
+		const Dtype* pic, Dtype* V, const int count) {
+	sample_plan_scalar<TAPS>(offset, weight, stride, pic, V, 0, count);
+}
 
-	return res;
+// float samples go through the widest vector unit reported by CPUID, with the scalar
+// kernel finishing the remainder of the row.
+template <int TAPS>
+static void sample_plan_cpu(const int* offset, const float* weight, const int stride,
+		const float* pic, float* V, const int count) {
+	int done = 0;
+#ifdef ST_SIMD_DISPATCH
+	static const SimdLevel cpu_simd_level = detect_simd_level();
+	const int simd_level = std::min<int>(cpu_simd_level, max_simd_level);
+	if(simd_level == SIMD_AVX512) {
+		done = sample_plan_avx512<TAPS>(offset, weight, stride, pic, V, count);
+	} else if(simd_level == SIMD_AVX2) {
+		done = sample_plan_avx2<TAPS>(offset, weight, stride, pic, V, count);
+	}
+#endif
+	sample_plan_scalar<TAPS>(offset, weight, stride, pic, V, done, count);
 }
 
 template <typename Dtype>
-void SpatialTransformerLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
-    const vector<Blob<Dtype>*>& top) {
+template <int S>
+inline void SpatialTransformerLayer<Dtype>::sampling_taps(const Dtype px, const Dtype py,
+		int* offset, Dtype* weight, Dtype* grad, const int stride, const int p) {
+
+	// the four bilinear taps of each output pixel are (m0, n0), (m0, n0+1), (m0+1, n0),
+	// (m0+1, n0+1); nearest has the single tap (round(x), round(y)).
+	// A tap that lies outside U (or past ceil(x) / ceil(y) when the coordinate is an integer)
+	// gets weight 0 and a clamped offset of 0, so samplers can read it unconditionally.
+	// Tap k of the pixel goes to k * stride + p, and with grad the bilinear gradient plan to
+	// 2 * k * stride + p and (2 * k + 1) * stride + p.
+
+	// calcul de x,y (position dans l'image)
+	const Dtype x = (px + 1) / 2 * H;
+	const Dtype y = (py + 1) / 2 * W;
+
+	if(S == NEAREST) {
+		const int m = floor(x + (Dtype)0.5), n = floor(y + (Dtype)0.5);
+		const bool inside = m >= 0 && m < H && n >= 0 && n < W;
+		offset[p] = inside ? m * W + n : 0;
+		weight[p] = inside ? (Dtype)1. : (Dtype)0.;
+		return;
+	}
 
-	string prefix = "\t\tSpatial Transformer Layer:: Forward_cpu: \t";
+	const int m0 = floor(x), n0 = floor(y);
+	const int m_last = ceil(x), n_last = ceil(y);
+
+	int k = 0;
+	for(int m = m0; m <= m0 + 1; ++m)
+		for(int n = n0; n <= n0 + 1; ++n, ++k) {
+			const int idx = k * stride + p;
+			const bool inside = m <= m_last && n <= n_last && m >= 0 && m < H && n >= 0 && n < W;
+			offset[idx] = inside ? m * W + n : 0;
+			weight[idx] = inside ? (1 - abs(x - m)) * (1 - abs(y - n)) : (Dtype)0.;
+			if(grad) {
+				grad[2 * k * stride + p] = inside ?
+						caffe_sign<Dtype>(m - x) * (1 - abs(y - n)) : (Dtype)0.;
+				grad[(2 * k + 1) * stride + p] = inside ?
+						caffe_sign<Dtype>(n - y) * (1 - abs(x - m)) : (Dtype)0.;
+			}
+		}
+}
 
-	// CHECK(false) << "Don't use the CPU implementation! If you really want to, delete the" <<
-	// 		" CHECK in st_layer.cpp file. Line number: 240-241." << std::endl;
+template <typename Dtype>
+template <int S>
+void SpatialTransformerLayer<Dtype>::build_sampling_plan(const Dtype* coordinates,
+		const int coordinates_stride, int* offset, Dtype* weight, Dtype* grad) {
+
+	// the plan of one image from its (px, py) in coordinates, stored tap-major (tap k of slot p
+	// at k * HW + p, see plan_slot) so that consecutive output pixels are contiguous for the
+	// vectorized sampler
+	const int HW = output_H_ * output_W_;
+	const int segment = plan_segment();
+	for(int s = 0; s < output_H_; ++s) {
+		for(int t_begin = 0; t_begin < output_W_; t_begin += segment) {
+
+			// pixel row_idx of the segment goes to plan slot p = row_idx + shift
+			const int row_begin = output_W_ * s + t_begin;
+			const int row_end = output_W_ * s + std::min(t_begin + segment, output_W_);
+			const int shift = plan_slot(s, t_begin) - row_begin;
+
+			for(int row_idx = row_begin; row_idx < row_end; ++row_idx) {
+				sampling_taps<S>(coordinates[row_idx * coordinates_stride],
+						coordinates[row_idx * coordinates_stride + 1], offset, weight, grad, HW,
+						row_idx + shift);
+			}
+		}
+	}
+}
 
-	if(global_debug) std::cout<<prefix<<"Starting!"<<std::endl;
+template <typename Dtype>
+template <int S>
+void SpatialTransformerLayer<Dtype>::build_block_plan(const Dtype* theta, const int s_begin,
+		const int s_end, const int t_begin, const int t_end, int* offset, Dtype* weight) {
+
+	// inference mode: the forward plan of output rows [s_begin, s_end) x columns [t_begin, t_end)
+	// only, with (px, py) projected from theta on the fly. Pixel (s, t) goes to slot
+	// (s - s_begin) * (t_end - t_begin) + t - t_begin, tap k of it one block further per tap.
+	// The output coordinates are computed like the entries of output_grid, which inference mode
+	// does not allocate.
+	const int block_W = t_end - t_begin;
+	const int stride = (s_end - s_begin) * block_W;
+	for(int s = s_begin; s < s_end; ++s) {
+		const Dtype gx = s * 1.0 / output_H_ * 2 - 1;
+		for(int t = t_begin; t < t_end; ++t) {
+			const Dtype gy = t * 1.0 / output_W_ * 2 - 1;
+			const Dtype px = gx * theta[0] + gy * theta[1] + theta[2];
+			const Dtype py = gx * theta[3] + gy * theta[4] + theta[5];
+			sampling_taps<S>(px, py, offset, weight, NULL, stride, (s - s_begin) * block_W + t - t_begin);
+		}
+	}
+}
 
-  //input layers : U and theta
-	const Dtype* U = bottom[0]->cpu_data();
-	const Dtype* theta = bottom[1]->cpu_data();
+static int l2_cache_bytes() {
+#if defined(__linux__) && defined(_SC_LEVEL2_CACHE_SIZE)
+	const long size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+	if(size > 0) return size;
+#endif
+	return 256 * 1024;
+}
 
-  Dtype* full_theta_data = full_theta.mutable_cpu_data();
+// slice of the per-thread buffers (inference plans) that the calling thread works in
+static inline int thread_index() {
+#ifdef _OPENMP
+	return omp_get_thread_num();
+#else
+	return 0;
+#endif
+}
+
+// src is num x channels x spatial, dst is num x spatial x channels. Pixels are moved in
+// blocks so that both the strided reads and the strided writes stay within a few lines.
+template <typename Dtype>
+static void transpose_channels_cpu(const Dtype* src, const int num, const int channels,
+		const int spatial, Dtype* dst, const bool to_channels_last, const int num_threads) {
+	const int block = 32;
+	const int num_blocks = (spatial + block - 1) / block;
+#ifdef _OPENMP
+	#pragma omp parallel for num_threads(num_threads) schedule(static)
+#endif
+	for(int r = 0; r < num * num_blocks; ++r) {
+		const int i = r / num_blocks;
+		const int p_begin = (r % num_blocks) * block;
+		const int p_end = std::min(p_begin + block, spatial);
+		const Dtype* src_i = src + i * channels * spatial;
+		Dtype* dst_i = dst + i * channels * spatial;
+		for(int c = 0; c < channels; ++c)
+			for(int p = p_begin; p < p_end; ++p) {
+				if(to_channels_last) {
+					dst_i[p * channels + c] = src_i[c * spatial + p];
+				} else {
+					dst_i[c * spatial + p] = src_i[p * channels + c];
+				}
+			}
+	}
+}
+
+template <typename Dtype>
+template <int S>
+void SpatialTransformerLayer<Dtype>::build_sampling_grid(const Dtype* full_theta_data) {
+
+	if(separable_) {
+		build_separable_plan<S>(full_theta_data);
+		return;
+	}
+
+	if(tiled_) {
+		tile_ = tile_size_ > 0 ? tile_size_ : auto_tile_size(full_theta_data);
+	}
+
+	const int taps = (S == NEAREST) ? 1 : 4;
+
+	if(inference_) {
+		// no grid and no per-image plan: the samplers build the plan of one block of output pixels
+		// at a time from full_theta (build_block_plan), into a slice per thread. A block is a tile,
+		// or a band of full rows whose plan takes at most a quarter of L2, so that every channel
+		// samples a few consecutive rows from the lines it has just loaded. The slices hold at
+		// least one full row, for the samplers that go row by row.
+		if(tiled_) {
+			block_H_ = block_W_ = tile_;
+		} else {
+			const int row_bytes = output_W_ * taps * (sizeof(int) + sizeof(Dtype));
+			block_H_ = std::max(1, std::min(output_H_, l2_cache_bytes() / 4 / row_bytes));
+			block_W_ = output_W_;
+		}
+		const int block = std::max(block_H_ * block_W_, output_W_);
+		plan_offset_.Reshape(num_threads_, taps, block, 1);
+		plan_weight_.Reshape(num_threads_, taps, block, 1);
+		return;
+	}
+
+	const int plan_size = output_H_ * output_W_ * taps;
+	int* plan_offset = plan_offset_.mutable_cpu_data();
+	Dtype* plan_weight = plan_weight_.mutable_cpu_data();
 
   // input_grid_data : pour chaque pixel de chaque image, px et py (coordonnées du pixel dans l'image input)
   Dtype* input_grid_data = input_grid.mutable_cpu_data();
 
 	const Dtype* output_grid_data = output_grid.cpu_data();
+	Dtype* plan_grad = (S == BILINEAR) ? plan_grad_.mutable_cpu_data() : NULL;
 
-  //output layer : V
-	Dtype* V = top[0]->mutable_cpu_data();
+  // Matrix multiplication for the whole batch : input_grid = output_grid_data x full_theta^T
+  // output_grid_data shape : (output_H_ * output_W_) x 3 => (x_i, y_i, 1)
+  // full_theta shape : N x 6, i.e. the N stacked 2 x 3 thetas form a (2 * N) x 3 matrix
+  // input_grid shape : (output_H_ * output_W_) x (2 * N)
+	caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans, output_H_ * output_W_, 2 * N, 3, (Dtype)1.,
+	      output_grid_data, full_theta_data, (Dtype)0., input_grid_data);
 
-  // intialize mutable_cpu_data arrays
-	caffe_set(input_grid.count(), (Dtype)0, input_grid_data);
-	caffe_set(top[0]->count(), (Dtype)0, V);
+	// for each input in the batch
+#ifdef _OPENMP
+	#pragma omp parallel for num_threads(num_threads_) schedule(static)
+#endif
+	for(int i = 0; i < N; ++i) {
+
+		// the geometry only depends on the image, every channel reuses the same plan
+		build_sampling_plan<S>(input_grid_data + 2 * i, 2 * N, plan_offset + plan_size * i,
+				plan_weight + plan_size * i, plan_grad ? plan_grad + 2 * plan_size * i : NULL);
+	}
+}
+
+template <typename Dtype>
+bool SpatialTransformerLayer<Dtype>::is_plan_theta(const Dtype* full_theta_data) {
+
+	// with all six parameters pre-defined the plan can never go stale
+	if(pre_defined_count == 6) return true;
+
+	const Dtype* plan_theta_data = plan_theta_.cpu_data();
+	for(int i = 0; i < full_theta.count(); ++i) {
+		if(plan_theta_data[i] != full_theta_data[i]) return false;
+	}
+	return true;
+}
+
+template <typename Dtype>
+int SpatialTransformerLayer<Dtype>::auto_tile_size(const Dtype* full_theta_data) {
+
+	// an output tile of T x T pixels maps onto a parallelogram of U whose bounding box spans
+	// T * extent_x + 2 rows and T * extent_y + 2 columns, with extent_* the absolute row sums of
+	// the affine map in source pixels per output pixel. Pick the largest multiple of 16 (a full
+	// AVX-512 row) whose box, in cache lines, takes at most half of L2 for every image.
+	const int budget = l2_cache_bytes() / 2;
+	const int line = 64;
+	const int max_tile = (std::max(output_H_, output_W_) + 15) / 16 * 16;
+
+	int tile = max_tile;
+	for(int i = 0; i < N; ++i) {
+		const Dtype* theta = full_theta_data + 6 * i;
+		const double extent_x = std::fabs(theta[0]) * H / output_H_ + std::fabs(theta[1]) * H / output_W_;
+		const double extent_y = std::fabs(theta[3]) * W / output_H_ + std::fabs(theta[4]) * W / output_W_;
+		while(tile > 16) {
+			const double rows = std::ceil(tile * extent_x) + 2;
+			const double lines = std::ceil((std::ceil(tile * extent_y) + 2) * sizeof(Dtype) / line) + 1;
+			if(rows * lines * line <= budget) break;
+			tile -= 16;
+		}
+	}
+	return tile;
+}
+
+template <typename Dtype>
+template <int S>
+void SpatialTransformerLayer<Dtype>::forward_sample_nhwc_cpu(const Dtype* U, Dtype* V) {
+
+	const int HW = output_H_ * output_W_;
+	const int taps = (S == NEAREST) ? 1 : 4;
+	const int plan_size = HW * taps;
+	// in inference mode every row builds its plan into the thread's slice of the buffers
+	const Dtype* full_theta_data = full_theta.cpu_data();
+	int* plan_offset = plan_offset_.mutable_cpu_data();
+	Dtype* plan_weight = plan_weight_.mutable_cpu_data();
+	const int block_size = plan_offset_.count(1);
+
+	Dtype* U_nhwc = U_nhwc_.mutable_cpu_data();
+	Dtype* V_nhwc = V_nhwc_.mutable_cpu_data();
+	transpose_channels_cpu(U, N / crops_, C, H * W, U_nhwc, true, num_threads_);
+
+	// one (transform, output row) per iteration; every tap reads the C channels of its source
+	// pixel contiguously and the channel loop vectorizes.
+#ifdef _OPENMP
+	#pragma omp parallel for num_threads(num_threads_) schedule(static)
+#endif
+	for(int r = 0; r < N * output_H_; ++r) {
+
+		const int i = r / output_H_;
+		const int s = r % output_H_;
+
+		// tap k of output pixel t of the row at offset[k * stride + base + t]
+		const int* offset = plan_offset + plan_size * i;
+		const Dtype* weight = plan_weight + plan_size * i;
+		int stride = HW, base = output_W_ * s;
+		if(inference_) {
+			int* row_offset = plan_offset + block_size * thread_index();
+			Dtype* row_weight = plan_weight + block_size * thread_index();
+			build_block_plan<S>(full_theta_data + 6 * i, s, s + 1, 0, output_W_, row_offset, row_weight);
+			offset = row_offset;
+			weight = row_weight;
+			stride = output_W_;
+			base = 0;
+		}
+		const Dtype* pic = U_nhwc + i / crops_ * H * W * C;
+
+		for(int t = 0; t < output_W_; ++t) {
+			const int p = base + t;
+			Dtype* out = V_nhwc + (i * HW + output_W_ * s + t) * C;
+			if(S == NEAREST) {
+				const Dtype w0 = weight[p];
+				const Dtype* in0 = pic + offset[p] * C;
+				for(int c = 0; c < C; ++c) {
+					out[c] = w0 * in0[c];
+				}
+				continue;
+			}
+			const Dtype w0 = weight[p], w1 = weight[stride + p];
+			const Dtype w2 = weight[2 * stride + p], w3 = weight[3 * stride + p];
+			const Dtype* in0 = pic + offset[p] * C;
+			const Dtype* in1 = pic + offset[stride + p] * C;
+			const Dtype* in2 = pic + offset[2 * stride + p] * C;
+			const Dtype* in3 = pic + offset[3 * stride + p] * C;
+			for(int c = 0; c < C; ++c) {
+				Dtype res = (Dtype)0.;
+				res += w0 * in0[c];
+				res += w1 * in1[c];
+				res += w2 * in2[c];
+				res += w3 * in3[c];
+				out[c] = res;
+			}
+		}
+	}
+
+	transpose_channels_cpu(V_nhwc, N, C, HW, V, false, num_threads_);
+}
+
+template <typename Dtype>
+template <int S>
+void SpatialTransformerLayer<Dtype>::backward_sample_nhwc_cpu(const Dtype* dV, Dtype* dU,
+		Dtype* input_grid_diff) {
+
+	const int HW = output_H_ * output_W_;
+	const int taps = (S == NEAREST) ? 1 : 4;
+	const int plan_size = HW * taps;
+	const int* plan_offset = plan_offset_.cpu_data();
+	const Dtype* plan_weight = plan_weight_.cpu_data();
+
+	// U_nhwc_ still holds U from the forward pass
+	const Dtype* U_nhwc = U_nhwc_.cpu_data();
+	Dtype* dU_nhwc = U_nhwc_.mutable_cpu_diff();
+	Dtype* dV_nhwc = V_nhwc_.mutable_cpu_diff();
+	transpose_channels_cpu(dV, N, C, HW, dV_nhwc, true, num_threads_);
+	caffe_set(U_nhwc_.count(), (Dtype)0, dU_nhwc);
+
+	// dU: one (image of U, block of channels) per iteration, so every element of dU is owned
+	// by a single iteration and scattered in crop then pixel order.
+	const int channel_block = 16;
+	const int num_channel_blocks = (C + channel_block - 1) / channel_block;
+#ifdef _OPENMP
+	#pragma omp parallel for num_threads(num_threads_) schedule(static)
+#endif
+	for(int r = 0; r < N / crops_ * num_channel_blocks; ++r) {
+
+		const int c_begin = (r % num_channel_blocks) * channel_block;
+		const int c_end = std::min(c_begin + channel_block, C);
+		Dtype* dU_pic = dU_nhwc + r / num_channel_blocks * H * W * C;
+
+		for(int i = r / num_channel_blocks * crops_; i < (r / num_channel_blocks + 1) * crops_; ++i) {
+
+			const int* offset = plan_offset + plan_size * i;
+			const Dtype* weight = plan_weight + plan_size * i;
+
+			for(int row_idx = 0; row_idx < HW; ++row_idx) {
+				const Dtype* dv = dV_nhwc + (i * HW + row_idx) * C;
+				for(int k = 0; k < taps; ++k) {
+					const Dtype w = weight[k * HW + row_idx];
+					Dtype* out = dU_pic + offset[k * HW + row_idx] * C;
+					for(int c = c_begin; c < c_end; ++c) {
+						out[c] += w * dv[c];
+					}
+				}
+			}
+		}
+	}
+
+	// d(px, py): one (image, output row) per iteration, each tap is a dot product over C.
+	// Nearest sampling is piecewise constant in (px, py), input_grid diff stays 0.
+	if(S == BILINEAR) {
+		const Dtype* plan_grad = plan_grad_.cpu_data();
+#ifdef _OPENMP
+		#pragma omp parallel for num_threads(num_threads_) schedule(static)
+#endif
+		for(int r = 0; r < N * output_H_; ++r) {
+
+			const int i = r / output_H_;
+			const int s = r % output_H_;
+
+			const int* offset = plan_offset + plan_size * i;
+			const Dtype* grad = plan_grad + 2 * plan_size * i;
+			const Dtype* pic = U_nhwc + i / crops_ * H * W * C;
+			Dtype* coordinates_diff = input_grid_diff + 2 * i;
+
+			for(int row_idx = output_W_ * s; row_idx < output_W_ * (s + 1); ++row_idx) {
+				const Dtype* dv = dV_nhwc + (i * HW + row_idx) * C;
+				Dtype dpx = (Dtype)0., dpy = (Dtype)0.;
+				for(int k = 0; k < 4; ++k) {
+					const Dtype a = caffe_cpu_dot(C, pic + offset[k * HW + row_idx] * C, dv);
+					dpx += grad[2 * k * HW + row_idx] * a * H / 2;
+					dpy += grad[(2 * k + 1) * HW + row_idx] * a * W / 2;
+				}
+				coordinates_diff[row_idx * 2 * N] = dpx;
+				coordinates_diff[row_idx * 2 * N + 1] = dpy;
+			}
+		}
+	}
+
+	transpose_channels_cpu(dU_nhwc, N / crops_, C, H * W, dU, false, num_threads_);
+}
+
+template <typename Dtype>
+template <int S>
+void SpatialTransformerLayer<Dtype>::forward_sample_cpu(const Dtype* U, Dtype* V) {
+
+	const int HW = output_H_ * output_W_;
+	const int taps = (S == NEAREST) ? 1 : 4;
+	const int plan_size = HW * taps;
+	if(inference_) {
+		// one (image, block of output pixels) per iteration: its plan is built into the thread's slice
+		// of plan_offset_ / plan_weight_ and then sampled for every channel. The taps follow the
+		// same rules as the full plan; only (px, py) come from a direct projection instead of the
+		// batched GEMM, which may round differently with an FMA-based BLAS.
+		const int block_H = block_H_, block_W = block_W_;
+		const int blocks_H = (output_H_ + block_H - 1) / block_H;
+		const int blocks_W = (output_W_ + block_W - 1) / block_W;
+		const int num_blocks = blocks_H * blocks_W;
+		const Dtype* full_theta_data = full_theta.cpu_data();
+		int* block_offset = plan_offset_.mutable_cpu_data();
+		Dtype* block_weight = plan_weight_.mutable_cpu_data();
+		const int block_size = plan_offset_.count(1);
+#ifdef _OPENMP
+		#pragma omp parallel for num_threads(num_threads_) schedule(static)
+#endif
+		for(int r = 0; r < N * num_blocks; ++r) {
+
+			const int i = r / num_blocks;
+			const int s_begin = (r % num_blocks) / blocks_W * block_H;
+			const int t_begin = (r % num_blocks) % blocks_W * block_W;
+			const int s_end = std::min(s_begin + block_H, output_H_);
+			const int t_end = std::min(t_begin + block_W, output_W_);
+			const int stride = (s_end - s_begin) * (t_end - t_begin);
+
+			int* offset = block_offset + block_size * thread_index();
+			Dtype* weight = block_weight + block_size * thread_index();
+			build_block_plan<S>(full_theta_data + 6 * i, s_begin, s_end, t_begin, t_end, offset, weight);
+
+			for(int j = 0; j < C; ++j) {
+				for(int s = s_begin; s < s_end; ++s) {
+					const int p = (s - s_begin) * (t_end - t_begin);
+					sample_plan_cpu<taps>(offset + p, weight + p, stride, U + (i / crops_ * C + j) * H * W,
+							V + (i * C + j) * HW + output_W_ * s + t_begin, t_end - t_begin);
+				}
+			}
+		}
+		return;
+	}
+
+	const int* plan_offset = plan_offset_.cpu_data();
+	const Dtype* plan_weight = plan_weight_.cpu_data();
+
+	if(tiled_) {
+		// one (image, channel, output tile) per iteration: the rows of a tile reuse the source
+		// lines loaded for the previous ones and its plan is one contiguous block. Each output
+		// pixel still goes through the same kernel, so V is identical to the row-by-row order.
+		const int tiles_H = (output_H_ + tile_ - 1) / tile_;
+		const int tiles_W = (output_W_ + tile_ - 1) / tile_;
+		const int num_tiles = tiles_H * tiles_W;
+#ifdef _OPENMP
+		#pragma omp parallel for num_threads(num_threads_) schedule(static)
+#endif
+		for(int r = 0; r < N * C * num_tiles; ++r) {
+
+			const int i = r / (C * num_tiles);
+			const int j = (r / num_tiles) % C;
+			const int s_begin = (r % num_tiles) / tiles_W * tile_;
+			const int t_begin = (r % num_tiles) % tiles_W * tile_;
+			const int s_end = std::min(s_begin + tile_, output_H_);
+			const int t_end = std::min(t_begin + tile_, output_W_);
+
+			for(int s = s_begin; s < s_end; ++s) {
+				const int p = plan_slot(s, t_begin);
+				sample_plan_cpu<taps>(plan_offset + plan_size * i + p, plan_weight + plan_size * i + p,
+						HW, U + (i / crops_ * C + j) * H * W, V + (i * C + j) * HW + output_W_ * s + t_begin,
+						t_end - t_begin);
+			}
+		}
+		return;
+	}
+
+	// parcours des pixels de l'output V, one (image, channel, output row) per iteration.
+	// Every output pixel is written by exactly one iteration, so V does not depend on the
+	// number of threads.
+	const int num_rows = N * C * output_H_;
+#ifdef _OPENMP
+	#pragma omp parallel for num_threads(num_threads_) schedule(static)
+#endif
+	for(int r = 0; r < num_rows; ++r) {
+
+		const int i = r / (C * output_H_);
+		const int j = (r / output_H_) % C;
+		const int s = r % output_H_;
+
+		sample_plan_cpu<taps>(plan_offset + plan_size * i + output_W_ * s,
+				plan_weight + plan_size * i + output_W_ * s, HW,
+				U + (i / crops_ * C + j) * H * W, V + (i * C + j) * HW + output_W_ * s, output_W_);
+	}
+}
+
+template <typename Dtype>
+template <int S>
+void SpatialTransformerLayer<Dtype>::backward_sample_cpu(const Dtype* dV, const Dtype* U,
+		Dtype* dU, Dtype* input_grid_diff) {
+
+	const int HW = output_H_ * output_W_;
+	const int taps = (S == NEAREST) ? 1 : 4;
+	const int plan_size = HW * taps;
+	const int segment = plan_segment();
+	const int* plan_offset = plan_offset_.cpu_data();
+	const Dtype* plan_weight = plan_weight_.cpu_data();
+
+	// both passes visit the output pixels row by row, whatever the plan order, so the sums do
+	// not depend on tiled_. Pixel row_idx of a segment has plan slot p = row_idx + shift.
+
+	// dU: every (image, channel) plane of dU only receives taps from the same channel of the
+	// crops of that image, so each iteration owns its plane and scatters into it, crop after
+	// crop, without synchronisation.
+#ifdef _OPENMP
+	#pragma omp parallel for num_threads(num_threads_) schedule(static)
+#endif
+	for(int r = 0; r < N / crops_ * C; ++r) {
+
+		const int j = r % C;
+		Dtype* dU_pic = dU + r * H * W;
+
+		for(int i = r / C * crops_; i < (r / C + 1) * crops_; ++i) {
+
+			const int* offset = plan_offset + plan_size * i;
+			const Dtype* weight = plan_weight + plan_size * i;
+			const Dtype* dV_pic = dV + (i * C + j) * HW;
+
+			for(int s = 0; s < output_H_; ++s) {
+				for(int t_begin = 0; t_begin < output_W_; t_begin += segment) {
+					const int row_begin = output_W_ * s + t_begin;
+					const int row_end = output_W_ * s + std::min(t_begin + segment, output_W_);
+					const int shift = plan_slot(s, t_begin) - row_begin;
+					for(int row_idx = row_begin; row_idx < row_end; ++row_idx) {
+						const Dtype dv = dV_pic[row_idx];
+						for(int k = 0; k < taps; ++k) {
+							dU_pic[offset[k * HW + row_idx + shift]] += dv * weight[k * HW + row_idx + shift];
+						}
+					}
+				}
+			}
+		}
+	}
+
+	// nearest sampling is piecewise constant in (px, py), input_grid diff stays 0
+	if(S == NEAREST) return;
+
+	// d(px, py): each (image, output row) owns its slice of input_grid diff and sums the
+	// channels in a fixed order, so the result does not depend on the number of threads.
+	const Dtype* plan_grad = plan_grad_.cpu_data();
+#ifdef _OPENMP
+	#pragma omp parallel for num_threads(num_threads_) schedule(static)
+#endif
+	for(int r = 0; r < N * output_H_; ++r) {
+
+		const int i = r / output_H_;
+		const int s = r % output_H_;
+
+		const int* offset = plan_offset + plan_size * i;
+		const Dtype* grad = plan_grad + 2 * plan_size * i;
+		Dtype* coordinates_diff = input_grid_diff + 2 * i;
+
+		for(int j = 0; j < C; ++j) {
 
-  // compute full_theta
+			const Dtype* dV_pic = dV + (i * C + j) * HW;
+			const Dtype* pic = U + (i / crops_ * C + j) * H * W;
+
+			for(int t_begin = 0; t_begin < output_W_; t_begin += segment) {
+				const int row_begin = output_W_ * s + t_begin;
+				const int row_end = output_W_ * s + std::min(t_begin + segment, output_W_);
+				const int shift = plan_slot(s, t_begin) - row_begin;
+
+				for(int row_idx = row_begin; row_idx < row_end; ++row_idx) {
+
+					const int p = row_idx + shift;
+					const Dtype dv = dV_pic[row_idx];
+					Dtype delta_dpx = (Dtype)0., delta_dpy = (Dtype)0.;
+
+					for(int k = 0; k < 4; ++k) {
+						const Dtype u = pic[offset[k * HW + p]];
+						delta_dpx += grad[2 * k * HW + p] * u * dv * H / 2;
+						delta_dpy += grad[(2 * k + 1) * HW + p] * u * dv * W / 2;
+					}
+
+					coordinates_diff[row_idx * 2 * N] += delta_dpx;
+					coordinates_diff[row_idx * 2 * N + 1] += delta_dpy;
+				}
+			}
+		}
+	}
+}
+
+// The taps of a 1-D interpolation on [0, size), with the same rules as build_sampling_plan.
+// Linear (TAPS = 2): m0 = floor(x) and m0 + 1, a tap outside [0, size) or past ceil(x) gets
+// weight 0, sign 0 and index -1. Nearest (TAPS = 1): round(x) with weight 1 and sign 0.
+template <int TAPS, typename Dtype>
+static void build_linear_taps(const Dtype x, const int size, int* index, Dtype* weight,
+		Dtype* sign, const int stride) {
+	if(TAPS == 1) {
+		const int m = floor(x + (Dtype)0.5);
+		const bool inside = m >= 0 && m < size;
+		index[0] = inside ? m : -1;
+		weight[0] = inside ? (Dtype)1. : (Dtype)0.;
+		sign[0] = (Dtype)0.;
+		return;
+	}
+	const int m0 = floor(x);
+	const int m_last = ceil(x);
+	for(int k = 0; k < TAPS; ++k) {
+		const int m = m0 + k;
+		const bool inside = m <= m_last && m >= 0 && m < size;
+		index[k * stride] = inside ? m : -1;
+		weight[k * stride] = inside ? 1 - std::fabs(x - m) : (Dtype)0.;
+		sign[k * stride] = inside ? (Dtype)caffe_sign<Dtype>(m - x) : (Dtype)0.;
+	}
+}
+
+template <typename Dtype>
+template <int S>
+void SpatialTransformerLayer<Dtype>::build_separable_plan(const Dtype* full_theta_data) {
+
+	// with theta_1_2 = theta_2_1 = 0, px only depends on the output row s and py only on the
+	// output column t: the row table holds the taps along H, the column table those along W.
+	const int taps = (S == NEAREST) ? 1 : 2;
+	const int table_size = taps * (output_H_ + output_W_);
+	const Dtype* output_grid_data = output_grid.cpu_data();
+
+	for(int i = 0; i < N; ++i) {
+
+		const Dtype* theta = full_theta_data + 6 * i;
+		int* index = sep_index_.mutable_cpu_data() + table_size * i;
+		Dtype* weight = sep_weight_.mutable_cpu_data() + table_size * i;
+		Dtype* sign = sep_sign_.mutable_cpu_data() + table_size * i;
+
+		for(int s = 0; s < output_H_; ++s) {
+			const Dtype px = output_grid_data[3 * output_W_ * s] * theta[0] + theta[2];
+			build_linear_taps<taps>((px + 1) / 2 * H, H, index + s, weight + s, sign + s, output_H_);
+		}
+		for(int t = 0; t < output_W_; ++t) {
+			const Dtype py = output_grid_data[3 * t + 1] * theta[4] + theta[5];
+			build_linear_taps<taps>((py + 1) / 2 * W, W, index + taps * output_H_ + t,
+					weight + taps * output_H_ + t, sign + taps * output_H_ + t, output_W_);
+		}
+
+		// clamp the unused taps onto a source row / column that is read anyway, so the column
+		// pass only covers the rows the row pass needs
+		int m_lo = H, n_lo = W;
+		for(int k = 0; k < taps * output_H_; ++k) {
+			if(index[k] >= 0) m_lo = std::min(m_lo, index[k]);
+		}
+		for(int k = taps * output_H_; k < table_size; ++k) {
+			if(index[k] >= 0) n_lo = std::min(n_lo, index[k]);
+		}
+		for(int k = 0; k < table_size; ++k) {
+			if(index[k] < 0) index[k] = (k < taps * output_H_) ? (m_lo < H ? m_lo : 0) : (n_lo < W ? n_lo : 0);
+		}
+	}
+}
+
+// rows of U touched by the row table of one image
+static inline void separable_row_range(const int* row_index, const int count, int& m_lo,
+		int& m_hi) {
+	m_lo = row_index[0];
+	m_hi = row_index[0];
+	for(int k = 1; k < count; ++k) {
+		m_lo = std::min(m_lo, row_index[k]);
+		m_hi = std::max(m_hi, row_index[k]);
+	}
+}
+
+template <typename Dtype>
+template <int S>
+void SpatialTransformerLayer<Dtype>::forward_sample_separable_cpu(const Dtype* U, Dtype* V) {
+
+	const int taps = (S == NEAREST) ? 1 : 2;
+	const int table_size = taps * (output_H_ + output_W_);
+
+	// one (transform, channel) plane per iteration: a column pass T[m][t] over the source rows in
+	// use, then a row pass V[s][t] = sum_k wx_k[s] * T[m_k[s]][t] that streams contiguously.
+#ifdef _OPENMP
+	#pragma omp parallel for num_threads(num_threads_) schedule(static)
+#endif
+	for(int r = 0; r < N * C; ++r) {
+
+		const int i = r / C;
+#ifdef _OPENMP
+		Dtype* T = sep_buffer_.mutable_cpu_data() + sep_buffer_.offset(omp_get_thread_num());
+#else
+		Dtype* T = sep_buffer_.mutable_cpu_data();
+#endif
+
+		const int* row_index = sep_index_.cpu_data() + table_size * i;
+		const Dtype* row_weight = sep_weight_.cpu_data() + table_size * i;
+		const int* col_index = row_index + taps * output_H_;
+		const Dtype* col_weight = row_weight + taps * output_H_;
+
+		const Dtype* pic = U + (i / crops_ * C + r % C) * H * W;
+		Dtype* V_pic = V + r * output_H_ * output_W_;
+
+		int m_lo, m_hi;
+		separable_row_range(row_index, taps * output_H_, m_lo, m_hi);
+
+		for(int m = m_lo; m <= m_hi; ++m) {
+			const Dtype* U_row = pic + m * W;
+			Dtype* T_row = T + (m - m_lo) * output_W_;
+			for(int t = 0; t < output_W_; ++t) {
+				Dtype res = col_weight[t] * U_row[col_index[t]];
+				for(int k = 1; k < taps; ++k) {
+					res += col_weight[k * output_W_ + t] * U_row[col_index[k * output_W_ + t]];
+				}
+				T_row[t] = res;
+			}
+		}
+
+		for(int s = 0; s < output_H_; ++s) {
+			Dtype* V_row = V_pic + s * output_W_;
+			const Dtype w0 = row_weight[s];
+			const Dtype* T0 = T + (row_index[s] - m_lo) * output_W_;
+			if(S == NEAREST) {
+				for(int t = 0; t < output_W_; ++t) {
+					V_row[t] = w0 * T0[t];
+				}
+				continue;
+			}
+			const Dtype w1 = row_weight[output_H_ + s];
+			const Dtype* T1 = T + (row_index[output_H_ + s] - m_lo) * output_W_;
+			for(int t = 0; t < output_W_; ++t) {
+				V_row[t] = w0 * T0[t] + w1 * T1[t];
+			}
+		}
+	}
+}
+
+template <typename Dtype>
+template <int S>
+void SpatialTransformerLayer<Dtype>::backward_sample_separable_cpu(const Dtype* dV,
+		const Dtype* U, Dtype* dU, Dtype* full_theta_diff) {
+
+	const int taps = (S == NEAREST) ? 1 : 2;
+	const int table_size = taps * (output_H_ + output_W_);
+	const int rows_cols = output_H_ + output_W_;
+	Dtype* partial = (S == BILINEAR) ? sep_theta_partial_.mutable_cpu_data() : NULL;
+
+	// one (image, channel) plane of U per iteration, its crops one after the other, so dU is
+	// owned by the iteration. Besides dU, each bilinear (transform, channel) plane writes its own
+	// sum_t dpx(s, t) for every output row s and sum_s dpy(s, t) for every output column t.
+#ifdef _OPENMP
+	#pragma omp parallel for num_threads(num_threads_) schedule(static)
+#endif
+	for(int u = 0; u < N / crops_ * C; ++u) {
+
+#ifdef _OPENMP
+		Dtype* T = sep_buffer_.mutable_cpu_data() + sep_buffer_.offset(omp_get_thread_num());
+#else
+		Dtype* T = sep_buffer_.mutable_cpu_data();
+#endif
+		const Dtype* pic = U + u * H * W;
+		Dtype* dU_pic = dU + u * H * W;
+
+		for(int i = u / C * crops_; i < (u / C + 1) * crops_; ++i) {
+
+			const int r = i * C + u % C;
+			const int* row_index = sep_index_.cpu_data() + table_size * i;
+			const Dtype* row_weight = sep_weight_.cpu_data() + table_size * i;
+			const Dtype* row_sign = sep_sign_.cpu_data() + table_size * i;
+			const int* col_index = row_index + taps * output_H_;
+			const Dtype* col_weight = row_weight + taps * output_H_;
+			const Dtype* col_sign = row_sign + taps * output_H_;
+
+			const Dtype* dV_pic = dV + r * output_H_ * output_W_;
+
+			int m_lo, m_hi;
+			separable_row_range(row_index, taps * output_H_, m_lo, m_hi);
+			const int rows = m_hi - m_lo + 1;
+
+			// T: column pass of U, G: column pass with the d/dy coefficients, dT: row pass of dV
+			Dtype* G = T + rows * output_W_;
+			Dtype* dT = G + rows * output_W_;
+			caffe_set(rows * output_W_, (Dtype)0., dT);
+
+			if(S == NEAREST) {
+				// piecewise constant in theta: only dU, through the transposed passes
+				for(int s = 0; s < output_H_; ++s) {
+					const Dtype w0 = row_weight[s];
+					const Dtype* dv = dV_pic + s * output_W_;
+					Dtype* dT_row = dT + (row_index[s] - m_lo) * output_W_;
+					for(int t = 0; t < output_W_; ++t) {
+						dT_row[t] += w0 * dv[t];
+					}
+				}
+				for(int m = m_lo; m <= m_hi; ++m) {
+					const Dtype* dT_row = dT + (m - m_lo) * output_W_;
+					Dtype* dU_row = dU_pic + m * W;
+					for(int t = 0; t < output_W_; ++t) {
+						dU_row[col_index[t]] += col_weight[t] * dT_row[t];
+					}
+				}
+				continue;
+			}
+
+			Dtype* row_partial = partial + r * rows_cols;
+			Dtype* col_partial = row_partial + output_H_;
+
+			for(int m = m_lo; m <= m_hi; ++m) {
+				const Dtype* U_row = pic + m * W;
+				Dtype* T_row = T + (m - m_lo) * output_W_;
+				Dtype* G_row = G + (m - m_lo) * output_W_;
+				for(int t = 0; t < output_W_; ++t) {
+					const Dtype u0 = U_row[col_index[t]], u1 = U_row[col_index[output_W_ + t]];
+					T_row[t] = col_weight[t] * u0 + col_weight[output_W_ + t] * u1;
+					G_row[t] = col_sign[t] * u0 + col_sign[output_W_ + t] * u1;
+				}
+			}
+			caffe_set(output_W_, (Dtype)0., col_partial);
+
+			for(int s = 0; s < output_H_; ++s) {
+				const int k0 = (row_index[s] - m_lo) * output_W_;
+				const int k1 = (row_index[output_H_ + s] - m_lo) * output_W_;
+				const Dtype w0 = row_weight[s], w1 = row_weight[output_H_ + s];
+				const Dtype g0 = row_sign[s], g1 = row_sign[output_H_ + s];
+				const Dtype* dv = dV_pic + s * output_W_;
+				Dtype dpx = (Dtype)0.;
+				for(int t = 0; t < output_W_; ++t) {
+					dpx += (g0 * T[k0 + t] + g1 * T[k1 + t]) * dv[t];
+					col_partial[t] += (w0 * G[k0 + t] + w1 * G[k1 + t]) * dv[t];
+					dT[k0 + t] += w0 * dv[t];
+					dT[k1 + t] += w1 * dv[t];
+				}
+				row_partial[s] = dpx * H / 2;
+			}
+			for(int t = 0; t < output_W_; ++t) {
+				col_partial[t] *= (Dtype)W / 2;
+			}
+
+			for(int m = m_lo; m <= m_hi; ++m) {
+				const Dtype* dT_row = dT + (m - m_lo) * output_W_;
+				Dtype* dU_row = dU_pic + m * W;
+				for(int t = 0; t < output_W_; ++t) {
+					dU_row[col_index[t]] += col_weight[t] * dT_row[t];
+					dU_row[col_index[output_W_ + t]] += col_weight[output_W_ + t] * dT_row[t];
+				}
+			}
+		}
+	}
+
+	caffe_set(full_theta.count(), (Dtype)0., full_theta_diff);
+	if(S == NEAREST) return;
+
+	// reduce the channels of every image in a fixed order, then project onto theta:
+	// d theta_1_1 = sum_s dpx_s * x_s, d theta_1_3 = sum_s dpx_s,
+	// d theta_2_2 = sum_t dpy_t * y_t, d theta_2_3 = sum_t dpy_t.
+	// theta_1_2 and theta_2_1 are pre-defined in this mode, their diff is left at 0.
+	const Dtype* output_grid_data = output_grid.cpu_data();
+	for(int i = 0; i < N; ++i) {
+		Dtype* theta_diff = full_theta_diff + 6 * i;
+		for(int j = 0; j < C; ++j) {
+			const Dtype* row_partial = partial + (i * C + j) * rows_cols;
+			const Dtype* col_partial = row_partial + output_H_;
+			for(int s = 0; s < output_H_; ++s) {
+				theta_diff[0] += row_partial[s] * output_grid_data[3 * output_W_ * s];
+				theta_diff[2] += row_partial[s];
+			}
+			for(int t = 0; t < output_W_; ++t) {
+				theta_diff[4] += col_partial[t] * output_grid_data[3 * t + 1];
+				theta_diff[5] += col_partial[t];
+			}
+		}
+	}
+}
+
+template <typename Dtype>
+template <int S>
+void SpatialTransformerLayer<Dtype>::forward_sample(const Dtype* U, Dtype* V) {
+	if(separable_) {
+		forward_sample_separable_cpu<S>(U, V);
+	} else if(channels_last_) {
+		forward_sample_nhwc_cpu<S>(U, V);
+	} else {
+		forward_sample_cpu<S>(U, V);
+	}
+}
+
+// Real value of one sample from 8-bit codes: with acc = sum_k w_k * q_k and wsum = sum_k w_k,
+// sum_k w_k * scale * (q_k - zero_point) = scale * (acc - zero_point * wsum). Taps outside U have
+// weight 0, i.e. read a real 0. QUANTIZED_V stores it as a code of the same scale and zero point,
+// rounded to nearest and saturated; otherwise V gets the real value.
+template <bool QUANTIZED_V, typename Q, typename Dtype>
+static inline void store_quantized_sample(const Dtype acc, const Dtype wsum, const Dtype scale,
+		const int zero_point, Dtype* V, Q* V_q, const int index) {
+	const Dtype code = acc - zero_point * wsum;
+	if(!QUANTIZED_V) {
+		V[index] = scale * code;
+		return;
+	}
+	const Dtype q = std::floor(code + zero_point + (Dtype)0.5);
+	V_q[index] = (Q)std::min<Dtype>(std::max<Dtype>(q, std::numeric_limits<Q>::min()),
+			std::numeric_limits<Q>::max());
+}
+
+template <typename Dtype>
+template <int S, bool QUANTIZED_V, typename Q>
+void SpatialTransformerLayer<Dtype>::forward_sample_quantized_cpu(const Q* U, const Dtype scale,
+		const int zero_point, Dtype* V, Q* V_q) {
+
+	const int HW = output_H_ * output_W_;
+
+	// The codes are widened one tap at a time, U is never converted as a whole.
+	if(separable_) {
+		// no 2-D plan: the taps of (s, t) are the products of the row taps of s and the column
+		// taps of t, one (transform, channel, output row) per iteration
+		const int num_rows = N * C * output_H_;
+		const int taps = (S == NEAREST) ? 1 : 2;
+		const int table_size = taps * (output_H_ + output_W_);
+#ifdef _OPENMP
+		#pragma omp parallel for num_threads(num_threads_) schedule(static)
+#endif
+		for(int r = 0; r < num_rows; ++r) {
+
+			const int i = r / (C * output_H_);
+			const int j = (r / output_H_) % C;
+			const int s = r % output_H_;
+
+			const int* row_index = sep_index_.cpu_data() + table_size * i;
+			const Dtype* row_weight = sep_weight_.cpu_data() + table_size * i;
+			const int* col_index = row_index + taps * output_H_;
+			const Dtype* col_weight = row_weight + taps * output_H_;
+			const Q* pic = U + (i / crops_ * C + j) * H * W;
+			const int out = (i * C + j) * HW + output_W_ * s;
+
+			for(int t = 0; t < output_W_; ++t) {
+				Dtype acc = (Dtype)0., wsum = (Dtype)0.;
+				for(int a = 0; a < taps; ++a)
+					for(int b = 0; b < taps; ++b) {
+						const Dtype w = row_weight[a * output_H_ + s] * col_weight[b * output_W_ + t];
+						acc += w * pic[row_index[a * output_H_ + s] * W + col_index[b * output_W_ + t]];
+						wsum += w;
+					}
+				store_quantized_sample<QUANTIZED_V>(acc, wsum, scale, zero_point, V, V_q, out + t);
+			}
+		}
+		return;
+	}
+
+	const int taps = (S == NEAREST) ? 1 : 4;
+	const int plan_size = HW * taps;
+	const Dtype* full_theta_data = full_theta.cpu_data();
+	int* plan_offset = plan_offset_.mutable_cpu_data();
+	Dtype* plan_weight = plan_weight_.mutable_cpu_data();
+	const int block_size = plan_offset_.count(1);
+
+	// one (transform, output row) per iteration here, so that in inference mode the plan of the
+	// row is built once into the thread's slice of the buffers and shared by all channels
+#ifdef _OPENMP
+	#pragma omp parallel for num_threads(num_threads_) schedule(static)
+#endif
+	for(int r = 0; r < N * output_H_; ++r) {
+
+		const int i = r / output_H_;
+		const int s = r % output_H_;
+
+		// tap k of the pixel in plan slot p at offset[k * stride + p]
+		const int* offset = plan_offset + plan_size * i;
+		const Dtype* weight = plan_weight + plan_size * i;
+		int stride = HW, segment = plan_segment();
+		if(inference_) {
+			int* row_offset = plan_offset + block_size * thread_index();
+			Dtype* row_weight = plan_weight + block_size * thread_index();
+			build_block_plan<S>(full_theta_data + 6 * i, s, s + 1, 0, output_W_, row_offset, row_weight);
+			offset = row_offset;
+			weight = row_weight;
+			stride = segment = output_W_;
+		}
+
+		for(int j = 0; j < C; ++j) {
+			const Q* pic = U + (i / crops_ * C + j) * H * W;
+
+			for(int t_begin = 0; t_begin < output_W_; t_begin += segment) {
+				const int t_end = std::min(t_begin + segment, output_W_);
+				const int slot = inference_ ? t_begin : plan_slot(s, t_begin);
+
+				for(int t = t_begin; t < t_end; ++t) {
+					const int p = slot + t - t_begin;
+					Dtype acc = (Dtype)0., wsum = (Dtype)0.;
+					for(int k = 0; k < taps; ++k) {
+						const Dtype w = weight[k * stride + p];
+						acc += w * pic[offset[k * stride + p]];
+						wsum += w;
+					}
+					const int out = (i * C + j) * HW + output_W_ * s + t;
+					store_quantized_sample<QUANTIZED_V>(acc, wsum, scale, zero_point, V, V_q, out);
+				}
+			}
+		}
+	}
+}
+
+template <typename Dtype>
+template <int S>
+void SpatialTransformerLayer<Dtype>::backward_sample(const Dtype* dV, const Dtype* U,
+		Dtype* dU, Dtype* full_theta_diff) {
+
+	if(separable_) {
+		backward_sample_separable_cpu<S>(dV, U, dU, full_theta_diff);
+		return;
+	}
+
+	Dtype* input_grid_diff = input_grid.mutable_cpu_diff();
+	caffe_set(input_grid.count(), (Dtype)0, input_grid_diff);
+
+	if(channels_last_) {
+		backward_sample_nhwc_cpu<S>(dV, dU, input_grid_diff);
+	} else {
+		backward_sample_cpu<S>(dV, U, dU, input_grid_diff);
+	}
+
+	// dTheta for the whole batch in one GEMM : full_theta diff = input_grid_diff^T x output_grid
+	// ((2 * N) x (output_H_ * output_W_) times (output_H_ * output_W_) x 3)
+	caffe_cpu_gemm<Dtype>(CblasTrans, CblasNoTrans, 2 * N, 3, output_H_ * output_W_, (Dtype)1.,
+			input_grid_diff, output_grid.cpu_data(), (Dtype)0., full_theta_diff);
+}
+
+template <typename Dtype>
+void SpatialTransformerLayer<Dtype>::prepare_sampling_plan(const Dtype* theta) {
+
+	string prefix = "\t\tSpatial Transformer Layer:: prepare_sampling_plan: \t";
+
+  Dtype* full_theta_data = full_theta.mutable_cpu_data();
+
+  // compute full_theta, one row per transform whatever the shape of theta (N x P or N x crops x P)
   if(global_debug) std::cout<<prefix<<"compute full theta"<< std::endl;
+  const int theta_count = 6 - pre_defined_count;
   int k = 0;
   for(int i=0; i<6; ++i) {
     if(is_pre_defined_theta[i]) {
@@ -251,72 +1447,99 @@ void SpatialTransformerLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bot
       if(global_debug) std::cout<<prefix<<"assigning predefined"<<pre_defined_theta[i] << std::endl;
     } else {
       for(int j = 0; j < N ; j++){
-        full_theta_data[full_theta.offset(j,i)] = theta[bottom[1]->offset(j,k)];
-        if(global_debug) std::cout<<prefix<<"assigning "<<theta[bottom[1]->offset(j,k)] << std::endl;
+        full_theta_data[full_theta.offset(j,i)] = theta[j * theta_count + k];
+        if(global_debug) std::cout<<prefix<<"assigning "<<theta[j * theta_count + k] << std::endl;
       }
       ++ k;
     }
   }
 
-	// for each input in the batch
-	for(int i = 0; i < N; ++i) {
+	// the grid and the plan only depend on full_theta: keep them while it is unchanged, e.g.
+	// for a fully pre-defined theta or a localisation net that is not being trained.
+	if(!plan_valid_ || !is_plan_theta(full_theta_data)) {
+		if(global_debug) std::cout<<prefix<<"rebuilding the sampling plan"<<std::endl;
+		if(sampler_ == NEAREST) {
+			build_sampling_grid<NEAREST>(full_theta_data);
+		} else {
+			build_sampling_grid<BILINEAR>(full_theta_data);
+		}
+		caffe_copy(full_theta.count(), full_theta_data, plan_theta_.mutable_cpu_data());
+		plan_valid_ = true;
+	}
+}
+
+template <typename Dtype>
+void SpatialTransformerLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+    const vector<Blob<Dtype>*>& top) {
+
+	string prefix = "\t\tSpatial Transformer Layer:: Forward_cpu: \t";
 
-		Dtype* coordinates = input_grid_data + (output_H_ * output_W_ * 2) * i;
+	// CHECK(false) << "Don't use the CPU implementation! If you really want to, delete the" <<
+	// 		" CHECK in st_layer.cpp file. Line number: 240-241." << std::endl;
 
-    // Matrix multiplication : coordinates = output_grid_data x theta
-    // output_grid_data shape : (output_H_ * output_W_) x 3 => (x_i, y_i, 1)
-    // transposed theta shape : 2 x 3
-    // (theta shape : 3 x 2)
-		caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans, output_H_ * output_W_, 2, 3, (Dtype)1.,
-		      output_grid_data, full_theta_data + 6 * i, (Dtype)0., coordinates);
+	if(global_debug) std::cout<<prefix<<"Starting!"<<std::endl;
 
-		int row_idx; Dtype px, py;
+  //input layers : U and theta
+	const Dtype* U = bottom[0]->cpu_data();
+	const Dtype* theta = bottom[1]->cpu_data();
 
-    // parcours des pixels de l'output V
-		for(int j = 0; j < C; ++j)
-			for(int s = 0; s < output_H_; ++s)
-				for(int t = 0; t < output_W_; ++t) {
+  //output layer : V
+	Dtype* V = top[0]->mutable_cpu_data();
 
-					row_idx = output_W_ * s + t;
+  // intialize mutable_cpu_data arrays
+	caffe_set(top[0]->count(), (Dtype)0, V);
 
-					px = coordinates[row_idx * 2];
-					py = coordinates[row_idx * 2 + 1];
-// Dtype x = (px + 1) / 2 * H;
-//std::cout<<prefix<<"Hum."<< px << ","<< py <<std::endl;
+	prepare_sampling_plan(theta);
 
-					V[top[0]->offset(i, j, s, t)] = transform_forward_cpu(
-							U + bottom[0]->offset(i, j, 0, 0), px, py);
-				}
+	if(sampler_ == NEAREST) {
+		forward_sample<NEAREST>(U, V);
+	} else {
+		forward_sample<BILINEAR>(U, V);
 	}
 
 	if(global_debug) std::cout<<prefix<<"Finished."<<std::endl;
 }
 
+// Forward pass from 8-bit U, e.g. decoded images that were never widened to Dtype. U is laid
+// out like bottom[0] (N x C x H x W codes, real value scale * (q - zero_point)); bottom[0] only
+// provides the shape and its data is never read. V is written to top[0] as real values or, when
+// V_quantized is given, to V_quantized as codes with the same scale and zero point, and top[0]
+// is left untouched. The taps are interpolated in Dtype: real V matches Forward_cpu on the
+// dequantized U up to Dtype rounding (a few ulps of scale * 255), quantized V is within half a
+// code of quantizing that result. Forward only, the same plan and modes as Forward_cpu apart
+// from channels_last, which is ignored.
 template <typename Dtype>
-void SpatialTransformerLayer<Dtype>::transform_backward_cpu(Dtype dV, const Dtype* U, const Dtype px,
-		const Dtype py, Dtype* dU, Dtype& dpx, Dtype& dpy) {
-
-	bool debug = false;
-	string prefix = "\t\tSpatial Transformer Layer:: transform_backward_cpu: \t";
-	if(debug) std::cout<<prefix<<"Starting!"<<std::endl;
-
-  // position (x,y)
-	Dtype x = (px + 1) / 2 * H;
-  Dtype y = (py + 1) / 2 * W;
-	if(debug) std::cout<<prefix<<"(x, y) = ("<<x<<", "<<y<<")"<<std::endl;
-
-  for(int m = floor(x); m <= ceil(x); ++m)
-    for(int n = floor(y); n <= ceil(y); ++n) {
-	    if(debug) std::cout<<prefix<<"(m, n) = ("<<m<<", "<<n<<")"<<std::endl;
-    	if(m >= 0 && m < H && n >= 0 && n < W) {
-    		dU[m * W + n] += dV * (1 - abs(x - m)) * (1 - abs(y - n));
-        dpx += caffe_sign<Dtype>(m - x) * (1 - abs(y - n)) * U[m * W + n] * dV * H / 2;
-    		dpy += caffe_sign<Dtype>(n - y) * (1 - abs(x - m)) * U[m * W + n] * dV * W / 2;
-    		if(debug) std::cout<<prefix<<"dpy += "<<max(0, 1 - abs(x - m))<<" * "<<U[m * W + n]<<" * "<<dV<<" * "<<W / 2<<std::endl;
-    	}
-    }
+template <typename Q>
+void SpatialTransformerLayer<Dtype>::Forward_quantized_cpu(const vector<Blob<Dtype>*>& bottom,
+		const vector<Blob<Dtype>*>& top, const Q* U, const Dtype scale, const int zero_point,
+		Q* V_quantized) {
+
+	string prefix = "\t\tSpatial Transformer Layer:: Forward_quantized_cpu: \t";
 
-	if(debug) std::cout<<prefix<<"Finished."<<std::endl;
+	if(global_debug) std::cout<<prefix<<"Starting!"<<std::endl;
+
+	CHECK(zero_point >= std::numeric_limits<Q>::min() && zero_point <= std::numeric_limits<Q>::max())
+			<< prefix << "zero_point " << zero_point << " is not a code of the input type" << std::endl;
+
+	Reshape(bottom, top);
+	prepare_sampling_plan(bottom[1]->cpu_data());
+
+	Dtype* V = V_quantized ? NULL : top[0]->mutable_cpu_data();
+	if(sampler_ == NEAREST) {
+		if(V_quantized) {
+			forward_sample_quantized_cpu<NEAREST, true>(U, scale, zero_point, V, V_quantized);
+		} else {
+			forward_sample_quantized_cpu<NEAREST, false>(U, scale, zero_point, V, V_quantized);
+		}
+	} else {
+		if(V_quantized) {
+			forward_sample_quantized_cpu<BILINEAR, true>(U, scale, zero_point, V, V_quantized);
+		} else {
+			forward_sample_quantized_cpu<BILINEAR, false>(U, scale, zero_point, V, V_quantized);
+		}
+	}
+
+	if(global_debug) std::cout<<prefix<<"Finished."<<std::endl;
 }
 
 template <typename Dtype>
@@ -331,56 +1554,33 @@ void SpatialTransformerLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& to
 
 		if(global_debug) std::cout<<prefix<<"Starting!"<<std::endl;
 
+		CHECK(!inference_) << prefix << "The layer was set up with st_param { forward_only: true } "
+				<< "and keeps no backward buffers." << std::endl;
+
 		const Dtype* dV = top[0]->cpu_diff();
-		const Dtype* input_grid_data = input_grid.cpu_data();
 		const Dtype* U = bottom[0]->cpu_data();
 
 		Dtype* dU = bottom[0]->mutable_cpu_diff();
 		Dtype* dTheta = bottom[1]->mutable_cpu_diff();
-		Dtype* input_grid_diff = input_grid.mutable_cpu_diff();
+		Dtype* full_theta_diff = full_theta.mutable_cpu_diff();
 
 		caffe_set(bottom[0]->count(), (Dtype)0, dU);
-		caffe_set(bottom[1]->count(), (Dtype)0, dTheta);
-		caffe_set(input_grid.count(), (Dtype)0, input_grid_diff);
-
-    // for each image in batch
-		for(int i = 0; i < N; ++i) {
-
-      // gets projection coordinate for each input
-			const Dtype* coordinates = input_grid_data + (output_H_ * output_W_ * 2) * i;
-			Dtype* coordinates_diff = input_grid_diff + (output_H_ * output_W_ * 2) * i;
-
-			int row_idx; Dtype px, py, dpx, dpy, delta_dpx, delta_dpy;
-
-			for(int s = 0; s < output_H_; ++s)
-				for(int t = 0; t < output_W_; ++t) {
-
-					row_idx = output_W_ * s + t;
 
-					px = coordinates[row_idx * 2];
-					py = coordinates[row_idx * 2 + 1];
-
-					for(int j = 0; j < C; ++j) {
-
-						delta_dpx = delta_dpy = (Dtype)0.;
-
-						transform_backward_cpu(dV[top[0]->offset(i, j, s, t)], U + bottom[0]->offset(i, j, 0, 0),
-								px, py, dU + bottom[0]->offset(i, j, 0, 0), delta_dpx, delta_dpy);
-
-						coordinates_diff[row_idx * 2] += delta_dpx;
-						coordinates_diff[row_idx * 2 + 1] += delta_dpy;
-					}
-
-					dpx = coordinates_diff[row_idx * 2];
-					dpy = coordinates_diff[row_idx * 2 + 1];
+		if(sampler_ == NEAREST) {
+			backward_sample<NEAREST>(dV, U, dU, full_theta_diff);
+		} else {
+			backward_sample<BILINEAR>(dV, U, dU, full_theta_diff);
+		}
 
-					dTheta[6 * i] += dpx * (s * 1.0 / output_H_ * 2 - 1);
-					dTheta[6 * i + 1] += dpx * (t * 1.0 / output_W_ * 2 - 1);
-					dTheta[6 * i + 2] += dpx;
-					dTheta[6 * i + 3] += dpy * (s * 1.0 / output_H_ * 2 - 1);
-					dTheta[6 * i + 4] += dpy * (t * 1.0 / output_W_ * 2 - 1);
-					dTheta[6 * i + 5] += dpy;
-				}
+		// only the parameters that are not pre-defined come from bottom[1]
+		const int theta_count = 6 - pre_defined_count;
+		int k = 0;
+		for(int p = 0; p < 6; ++p) {
+			if(is_pre_defined_theta[p]) continue;
+			for(int i = 0; i < N; ++i) {
+				dTheta[i * theta_count + k] = full_theta_diff[full_theta.offset(i, p)];
+			}
+			++ k;
 		}
 
 		if(global_debug) std::cout<<prefix<<"Finished."<<std::endl;
@@ -391,6 +1591,17 @@ STUB_GPU(SpatialTransformerLayer);
 #endif
 
 INSTANTIATE_CLASS(SpatialTransformerLayer);
+
+#define INSTANTIATE_ST_QUANTIZED(Q) \
+	template void SpatialTransformerLayer<float>::Forward_quantized_cpu<Q>( \
+			const vector<Blob<float>*>& bottom, const vector<Blob<float>*>& top, const Q* U, \
+			const float scale, const int zero_point, Q* V_quantized); \
+	template void SpatialTransformerLayer<double>::Forward_quantized_cpu<Q>( \
+			const vector<Blob<double>*>& bottom, const vector<Blob<double>*>& top, const Q* U, \
+			const double scale, const int zero_point, Q* V_quantized)
+
+INSTANTIATE_ST_QUANTIZED(uint8_t);
+INSTANTIATE_ST_QUANTIZED(int8_t);
 REGISTER_LAYER_CLASS(SpatialTransformer);
 
 } // namespace caffe
@@ -5,6 +5,7 @@
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
+#include <algorithm>
 #include <cmath>
 
 #include "caffe/blob.hpp"
@@ -21,14 +22,33 @@ public:
 	explicit SpatialTransformerLayer(const LayerParameter& param)
       : Layer<Dtype>(param) {
 	      to_compute_dU_ = false;
+	      sampler_ = BILINEAR;
 	      global_debug = false; 
 	      pre_defined_count = 0;
+	      inference_ = false;
+	      channels_last_ = false;
+	      separable_ = false;
+	      tiled_ = false;
+	      tile_size_ = tile_ = 0;
+	      block_H_ = block_W_ = 0;
+	      plan_valid_ = false;
+	      N = C = H = W = 0;
+	      crops_ = 1;
       }
 	virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
 	virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
 
+	// forward pass from 8-bit U (uint8_t or int8_t codes), see st_layer.cpp
+	template <typename Q> void Forward_quantized_cpu(const vector<Blob<Dtype>*>& bottom,
+			const vector<Blob<Dtype>*>& top, const Q* U, const Dtype scale, const int zero_point,
+			Q* V_quantized = NULL);
+
+	// caps the vector unit of the float sampler: 0 scalar, 1 AVX2, 2 AVX-512 (the default),
+	// still bounded by what CPUID reports. Process-wide, meant for tests and benchmarks.
+	static void set_max_simd_level(const int level);
+
 	virtual inline const char* type() const { return "SpatialTransformer"; }
 	virtual inline int ExactNumBottomBlobs() const { return 2; }
 	virtual inline int ExactNumTopBlobs() const { return 1; }
@@ -44,27 +64,80 @@ protected:
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
 
 private:
+	// the sampler is chosen once in LayerSetUp and passed to every sampling kernel below as
+	// the template parameter S, so the per-pixel loops carry no branch on it
+	enum SamplerType { BILINEAR, NEAREST };
+
 	inline Dtype abs(Dtype x) {
-		if(x < 0) return -x; return x;
+		if(x < 0) return -x;
+		return x;
 	}
-	inline Dtype max(Dtype x, Dtype y) {
-		if(x < y) return y; return x;
+
+	// theta is N x crops x P only when it has exactly three axes, more than one crop and the
+	// P = 6 - pre_defined_count parameters on the last one; any other shape (N x P,
+	// N x P x 1 x 1, ...) holds one transform per row of its first axis.
+	inline bool theta_has_crops_axis(const Blob<Dtype>* theta) const {
+		return theta->num_axes() == 3 && theta->shape(1) > 1 && theta->shape(2) == 6 - pre_defined_count;
 	}
 
-	Dtype transform_forward_cpu(const Dtype* pic, Dtype px, Dtype py);
-	void transform_backward_cpu(Dtype dV, const Dtype* U, const Dtype px,
-			const Dtype py, Dtype* dU, Dtype& dpx, Dtype& dpy);
+	template <int S> void build_sampling_grid(const Dtype* full_theta_data);
+	template <int S> inline void sampling_taps(const Dtype px, const Dtype py, int* offset,
+			Dtype* weight, Dtype* grad, const int stride, const int p);
+	template <int S> void build_sampling_plan(const Dtype* coordinates,
+			const int coordinates_stride, int* offset, Dtype* weight, Dtype* grad);
+	template <int S> void build_block_plan(const Dtype* theta, const int s_begin, const int s_end,
+			const int t_begin, const int t_end, int* offset, Dtype* weight);
+	bool is_plan_theta(const Dtype* full_theta_data);
+	void prepare_sampling_plan(const Dtype* theta);
+	int auto_tile_size(const Dtype* full_theta_data);
+
+	// index of output pixel (s, t) in the plan: row-major, or tile after tile when tiled_.
+	// Within a tile the pixels of a row stay contiguous.
+	inline int plan_slot(const int s, const int t) const {
+		if(!tiled_) return s * output_W_ + t;
+		const int band = s / tile_ * tile_;
+		const int tile_x = t / tile_ * tile_;
+		return band * output_W_ + tile_x * std::min(tile_, output_H_ - band)
+				+ (s - band) * std::min(tile_, output_W_ - tile_x) + t - tile_x;
+	}
+	// output columns per plan segment
+	inline int plan_segment() const { return tiled_ ? tile_ : output_W_; }
+	template <int S> void forward_sample(const Dtype* U, Dtype* V);
+	template <int S> void backward_sample(const Dtype* dV, const Dtype* U, Dtype* dU,
+			Dtype* full_theta_diff);
+	template <int S> void forward_sample_cpu(const Dtype* U, Dtype* V);
+	template <int S> void backward_sample_cpu(const Dtype* dV, const Dtype* U, Dtype* dU,
+			Dtype* input_grid_diff);
+	template <int S> void forward_sample_nhwc_cpu(const Dtype* U, Dtype* V);
+	template <int S> void backward_sample_nhwc_cpu(const Dtype* dV, Dtype* dU,
+			Dtype* input_grid_diff);
+	template <int S, bool QUANTIZED_V, typename Q> void forward_sample_quantized_cpu(const Q* U,
+			const Dtype scale, const int zero_point, Dtype* V, Q* V_q);
+	template <int S> void build_separable_plan(const Dtype* full_theta_data);
+	template <int S> void forward_sample_separable_cpu(const Dtype* U, Dtype* V);
+	template <int S> void backward_sample_separable_cpu(const Dtype* dV, const Dtype* U, Dtype* dU,
+			Dtype* full_theta_diff);
 
 	string transform_type_;
-	string sampler_type_;
+	SamplerType sampler_;
 
 	int output_H_;
 	int output_W_;
 
-	int N, C, H, W;
+	int N, C, H, W;	// N transforms (images of V), H and W of U
+	int crops_;	// transforms per image of U: transform i samples image i / crops_
+
+	int num_threads_;	// threads used by the CPU implementation
 
 	bool global_debug;
 	bool to_compute_dU_;
+	bool inference_;	// st_param forward_only: no input_grid, no per-image plan and no backward buffers
+	bool channels_last_;	// sample from an NHWC copy of U instead of the NCHW planes
+	bool separable_;	// axis-aligned theta: separate row and column passes instead of the 2-D plan
+	bool tiled_;	// sample the 2-D plan in output tiles of tile_ x tile_ pixels
+	int tile_size_;	// requested tile edge, 0 for auto_tile_size
+	int tile_;	// tile edge in use for the current plan
+	int block_H_, block_W_;	// inference mode: output rows x columns of the plan built at a time
 
 	Blob<Dtype> dTheta_tmp;	// used for back propagation part in GPU implementation
 	Blob<Dtype> all_ones_2;	// used for back propagation part in GPU implementation
@@ -75,7 +148,30 @@ private:
 	int pre_defined_count;
 
 	Blob<Dtype> output_grid;	// standard output coordinate system, [0, 1) by [0, 1).
-	Blob<Dtype> input_grid;	// corresponding coordinate on input image after projection for each output pixel.
+	Blob<Dtype> input_grid;	// corresponding coordinate on input image after projection for each output pixel, HW x N x 2.
+
+	// sampling plan built once per image from input_grid and shared by all channels.
+	// all three are stored tap-major: N x taps x (output_H_ * output_W_), 4 taps for bilinear, 1 for nearest,
+	// with the pixels in plan_slot order. In inference mode plan_offset_ and plan_weight_ instead hold
+	// the plan of one block_H_ x block_W_ block of output pixels per thread, see build_block_plan.
+	Blob<int> plan_offset_;	// source offsets m * W + n per output pixel, clamped to 0 outside U
+	Blob<Dtype> plan_weight_;	// weight of each tap, 0 for taps outside U
+	Blob<Dtype> plan_grad_;	// d weight / dx and d weight / dy of each bilinear tap (N x 8 x HW), for Backward_cpu
+
+	bool plan_valid_;	// input_grid and the plan were built from plan_theta_ for the current shape
+	Blob<Dtype> plan_theta_;	// full_theta the current plan was built from
+
+	// separable plan for axis-aligned transforms, per image the taps of every output row followed
+	// by the taps of every output column: N x taps * (output_H_ + output_W_), 2 taps for
+	// bilinear, 1 for nearest.
+	Blob<int> sep_index_;	// source row / column of each tap
+	Blob<Dtype> sep_weight_;	// linear weight of each tap, 0 when unused
+	Blob<Dtype> sep_sign_;	// sign(m - x) / sign(n - y) of each tap, for Backward_cpu
+	Blob<Dtype> sep_buffer_;	// per-thread column passes
+	Blob<Dtype> sep_theta_partial_;	// per (image, channel) sums of dpx over each row and dpy over each column
+
+	Blob<Dtype> U_nhwc_;	// channels-last U (data) and dU (diff)
+	Blob<Dtype> V_nhwc_;	// channels-last V (data) and dV (diff)
 };
 
 }  // namespace caffe
@@ -0,0 +1,219 @@
+#include <stdint.h>
+
+#include <cfloat>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/layers/st_layer.hpp"
+#include "caffe/util/math_functions.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+// The float sampler dispatches to AVX-512, AVX2 or the scalar kernel. Every path is forced
+// in turn and must give exactly the scalar output, which in turn must match a direct
+// evaluation of the bilinear / nearest formula of the original transform_forward_cpu.
+class SpatialTransformerSamplerTest : public CPUDeviceTest<float> {
+ protected:
+  SpatialTransformerSamplerTest()
+      : blob_bottom_U_(new Blob<float>(2, 3, 37, 53)),
+        blob_bottom_theta_(new Blob<float>()),
+        blob_top_V_(new Blob<float>()) {
+    // odd sizes, so every output row ends in a scalar remainder
+    float* U = blob_bottom_U_->mutable_cpu_data();
+    for (int i = 0; i < blob_bottom_U_->count(); ++i) {
+      U[i] = std::sin(i * 0.37f);
+    }
+    // rotated, zoomed out and shifted, so part of every output falls outside U
+    vector<int> theta_shape(2);
+    theta_shape[0] = 2;
+    theta_shape[1] = 6;
+    blob_bottom_theta_->Reshape(theta_shape);
+    float* theta = blob_bottom_theta_->mutable_cpu_data();
+    for (int i = 0; i < 2; ++i) {
+      const float angle = 0.4f + 0.3f * i, zoom = 1.3f;
+      theta[6 * i + 0] = zoom * std::cos(angle);
+      theta[6 * i + 1] = -zoom * std::sin(angle);
+      theta[6 * i + 2] = 0.15f;
+      theta[6 * i + 3] = zoom * std::sin(angle);
+      theta[6 * i + 4] = zoom * std::cos(angle);
+      theta[6 * i + 5] = -0.2f;
+    }
+    blob_bottom_vec_.push_back(blob_bottom_U_);
+    blob_bottom_vec_.push_back(blob_bottom_theta_);
+    blob_top_vec_.push_back(blob_top_V_);
+  }
+  virtual ~SpatialTransformerSamplerTest() {
+    SpatialTransformerLayer<float>::set_max_simd_level(2);
+    delete blob_bottom_U_;
+    delete blob_bottom_theta_;
+    delete blob_top_V_;
+  }
+
+  static bool SimdLevelSupported(const int level) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    if (level == 1) return __builtin_cpu_supports("avx2");
+    if (level == 2) return __builtin_cpu_supports("avx512f");
+#endif
+    return level == 0;
+  }
+
+  // V of a fresh layer with the sampler capped at simd_level
+  vector<float> Forward(const string& sampler_type, const int simd_level) {
+    LayerParameter layer_param;
+    SpatialTransformerParameter* st_param = layer_param.mutable_st_param();
+    st_param->set_sampler_type(sampler_type);
+    st_param->set_output_h(29);
+    st_param->set_output_w(41);
+    SpatialTransformerLayer<float>::set_max_simd_level(simd_level);
+    SpatialTransformerLayer<float> layer(layer_param);
+    layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+    layer.Forward(blob_bottom_vec_, blob_top_vec_);
+    return vector<float>(blob_top_V_->cpu_data(),
+        blob_top_V_->cpu_data() + blob_top_V_->count());
+  }
+
+  // direct per-pixel evaluation of the sampling formula
+  float Reference(const bool nearest, const int n, const int c, const int s,
+      const int t) {
+    const int H = blob_bottom_U_->height(), W = blob_bottom_U_->width();
+    const float* pic = blob_bottom_U_->cpu_data() + blob_bottom_U_->offset(n, c);
+    const float* theta = blob_bottom_theta_->cpu_data() + 6 * n;
+    const float gx = s * 1.0 / 29 * 2 - 1, gy = t * 1.0 / 41 * 2 - 1;
+    const float x = (gx * theta[0] + gy * theta[1] + theta[2] + 1) / 2 * H;
+    const float y = (gx * theta[3] + gy * theta[4] + theta[5] + 1) / 2 * W;
+    if (nearest) {
+      const int m = std::floor(x + 0.5f), k = std::floor(y + 0.5f);
+      return (m >= 0 && m < H && k >= 0 && k < W) ? pic[m * W + k] : 0.f;
+    }
+    float res = 0;
+    for (int m = std::floor(x); m <= std::floor(x) + 1; ++m) {
+      for (int k = std::floor(y); k <= std::floor(y) + 1; ++k) {
+        if (m > std::ceil(x) || k > std::ceil(y)) continue;
+        if (m < 0 || m >= H || k < 0 || k >= W) continue;
+        res += (1 - std::fabs(x - m)) * (1 - std::fabs(y - k)) * pic[m * W + k];
+      }
+    }
+    return res;
+  }
+
+  void TestSampler(const string& sampler_type) {
+    const vector<float> scalar = Forward(sampler_type, 0);
+    for (int n = 0; n < 2; ++n) {
+      for (int c = 0; c < 3; ++c) {
+        for (int s = 0; s < 29; ++s) {
+          for (int t = 0; t < 41; ++t) {
+            EXPECT_NEAR(scalar[((n * 3 + c) * 29 + s) * 41 + t],
+                Reference(sampler_type == "nearest", n, c, s, t), 1e-5);
+          }
+        }
+      }
+    }
+    for (int level = 1; level <= 2; ++level) {
+      if (!SimdLevelSupported(level)) {
+        LOG(INFO) << "Skipping SIMD level " << level << ", not supported by this CPU";
+        continue;
+      }
+      const vector<float> simd = Forward(sampler_type, level);
+      ASSERT_EQ(scalar.size(), simd.size());
+      for (int i = 0; i < static_cast<int>(scalar.size()); ++i) {
+        EXPECT_EQ(scalar[i], simd[i]) << "SIMD level " << level << " at " << i;
+      }
+    }
+  }
+
+  // Forward_quantized_cpu on 8-bit codes against Forward on their dequantized values: real V
+  // to float rounding of the 255-code range, quantized V within half a code. The fixture theta
+  // samples partly outside U, where the real value is 0, i.e. the code zero_point.
+  template <typename Q>
+  void TestQuantized(const string& sampler_type, const int zero_point, const float scale) {
+    vector<Q> U_q(blob_bottom_U_->count());
+    float* U = blob_bottom_U_->mutable_cpu_data();
+    const int lo = std::numeric_limits<Q>::min();
+    for (int i = 0; i < blob_bottom_U_->count(); ++i) {
+      U_q[i] = static_cast<Q>(lo + (i * 97 + i / 7) % 256);
+      U[i] = scale * (static_cast<int>(U_q[i]) - zero_point);
+    }
+    const vector<float> expected = Forward(sampler_type, 2);
+
+    LayerParameter layer_param;
+    SpatialTransformerParameter* st_param = layer_param.mutable_st_param();
+    st_param->set_sampler_type(sampler_type);
+    st_param->set_output_h(29);
+    st_param->set_output_w(41);
+    SpatialTransformerLayer<float> layer(layer_param);
+    layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+    // bottom[0] only gives the shape
+    caffe_set(blob_bottom_U_->count(), 0.f, U);
+    layer.Forward_quantized_cpu(blob_bottom_vec_, blob_top_vec_, &U_q[0], scale, zero_point);
+    ASSERT_EQ(static_cast<int>(expected.size()), blob_top_V_->count());
+    const float* V = blob_top_V_->cpu_data();
+    for (int i = 0; i < blob_top_V_->count(); ++i) {
+      EXPECT_NEAR(expected[i], V[i], 4 * scale * 255 * FLT_EPSILON) << i;
+    }
+    vector<Q> V_q(blob_top_V_->count());
+    layer.Forward_quantized_cpu(blob_bottom_vec_, blob_top_vec_, &U_q[0], scale, zero_point,
+        &V_q[0]);
+    for (int i = 0; i < blob_top_V_->count(); ++i) {
+      EXPECT_NEAR(expected[i] / scale, static_cast<int>(V_q[i]) - zero_point, 0.5 + 1e-4) << i;
+    }
+  }
+
+  Blob<float>* const blob_bottom_U_;
+  Blob<float>* const blob_bottom_theta_;
+  Blob<float>* const blob_top_V_;
+  vector<Blob<float>*> blob_bottom_vec_;
+  vector<Blob<float>*> blob_top_vec_;
+};
+
+TEST_F(SpatialTransformerSamplerTest, TestBilinearDispatch) {
+  TestSampler("bilinear");
+}
+
+TEST_F(SpatialTransformerSamplerTest, TestNearestDispatch) {
+  TestSampler("nearest");
+}
+
+// theta reshaped to N x 6 x 1 x 1 (as an InnerProduct + Reshape head emits it), N x 1 x 6
+// or N x 6 x 1 still holds one transform per image; only N x crops x 6 adds crops.
+TEST_F(SpatialTransformerSamplerTest, TestThetaShapes) {
+  const vector<float> flat = Forward("bilinear", 0);
+  const int shapes[3][4] = {{2, 6, 1, 1}, {2, 1, 6, 0}, {2, 6, 1, 0}};
+  for (int i = 0; i < 3; ++i) {
+    vector<int> theta_shape(shapes[i], shapes[i] + (shapes[i][3] ? 4 : 3));
+    blob_bottom_theta_->Reshape(theta_shape);
+    EXPECT_EQ(flat, Forward("bilinear", 0)) << "theta shape " << i;
+    EXPECT_EQ(2, blob_top_V_->num());
+  }
+  vector<int> crops_shape(3);
+  crops_shape[0] = 1;
+  crops_shape[1] = 2;
+  crops_shape[2] = 6;
+  blob_bottom_theta_->Reshape(crops_shape);
+  blob_bottom_U_->Reshape(1, 3, 37, 53);
+  const vector<float> crops = Forward("bilinear", 0);
+  EXPECT_EQ(2, blob_top_V_->num());
+  // both crops read the first image
+  for (int c = 0; c < 3 * 29 * 41; ++c) {
+    EXPECT_EQ(flat[c], crops[c]);
+  }
+}
+
+TEST_F(SpatialTransformerSamplerTest, TestQuantizedUint8) {
+  TestQuantized<uint8_t>("bilinear", 128, 0.02f);
+  TestQuantized<uint8_t>("nearest", 37, 0.02f);
+}
+
+TEST_F(SpatialTransformerSamplerTest, TestQuantizedInt8) {
+  TestQuantized<int8_t>("bilinear", -3, 0.05f);
+  TestQuantized<int8_t>("nearest", 11, 0.05f);
+}
+
+}  // namespace caffe